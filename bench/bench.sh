@@ -0,0 +1,41 @@
+#!/bin/sh
+# Compile each benchmark program with ./bfc, run it under ./z80emu, and
+# write a line of results for it to stdout. Any arguments are passed on to
+# bfc. This is what "make bench" runs; see the Makefile.
+#
+# The output is one line per program, with tab-separated columns:
+#
+#   program   the source file
+#   cycles    T-states to run it, including io_cycles
+#   io_cycles T-states charged for BDOS and BIOS calls
+#   bytes     size of the .COM file
+#   ms        milliseconds that bfc took to compile it
+#   output    CRC of the program's output, from cksum
+#
+# A program's input comes from the file with the same name ending in .in
+# instead of .bf, if there is one, and any extra options for bfc from the one
+# ending in .opt. e.bf would go on for ever, so it's
+# stopped after the first 500 digits.
+
+printf 'program\tcycles\tio_cycles\tbytes\tms\toutput\n'
+for src in mandelbrot.bf e.bf bench/*.bf; do
+    com=${src%.bf}.COM
+    in=${src%.bf}.in
+    [ -f "$in" ] || in=/dev/null
+    opt=
+    [ -f "${src%.bf}.opt" ] && opt=$(cat "${src%.bf}.opt")
+    limit=
+    [ "$src" = e.bf ] && limit="-n 502"
+
+    start=$(date +%s%N)
+    ./bfc "$@" $opt "$src" >/dev/null || exit 1
+    end=$(date +%s%N)
+
+    crc=$(./z80emu -q $limit "$com" <"$in" 2>bench/emu.err | cksum | cut -d' ' -f1)
+    cycles=$(sed -n 's/.*cycles=\([0-9]*\) io_cycles=\([0-9]*\).*/\1\t\2/p' bench/emu.err)
+    [ -n "$cycles" ] || { cat bench/emu.err >&2; exit 1; }
+
+    printf '%s\t%s\t%s\t%s\t%s\n' "$src" "$cycles" "$(wc -c <"$com" | tr -d ' ')" \
+        $(((end - start) / 1000000)) "$crc"
+done
+rm -f bench/emu.err
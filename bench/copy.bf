@@ -0,0 +1,19 @@
+Copy benchmark: lots of multiply and copy loops
+
+cell 1 = 100 (the outer counter)
+++++++++++[>++++++++++<-]>
+[
+    cell 2 = 200 (the inner counter) using cell 0 as a temporary
+    <++++++++++[>>++++++++++++++++++++<<-]>>
+    [
+        >+++++++++++++++++++++++++++++++++++++++++++++++++++  add 51 to cell 3
+        [->+>++>+++<<<]   add 1 2 and 3 times cell 3 to cells 4 5 and 6
+        >[-<+>]           move cell 4 back in to cell 3
+        >[->+>+<<]        add cell 5 to cells 6 and 7
+        >>[-<+>]          move cell 7 in to cell 6
+        <<<<<-
+    ]
+    <-
+]
+write cells 3 and 6
+>>.>>>.>++++++++++.
@@ -0,0 +1,16 @@
+Fill benchmark: clears and sets rows of cells; it runs with a one page tape
+(see fill dot opt) so that pointer movement can clobber the a register
+
+read a byte so that none of this is done at compile time
+,.
+then set cells 8 to 10 to 3 and print them going back down to the input
+>>>>>>>>[-]+++>[-]+++>[-]+++[.<]
+
+cell 0 = 200 (the counter)
+++++++++++[>++++++++++++++++++++<-]>
+[
+    >[-]>[-]>[-]>[-]>[-]>[-]>[-]>[-]
+    >[-]++>[-]++>[-]++>[-]++>[-]++>[-]++
+    <<<<<<<<<<<<<<-
+]
+>>>>>>>>>>>>>>.
@@ -0,0 +1,10 @@
+I/O benchmark: reads a line of input and writes it out 250 times
+
+read bytes in to cells 3 upwards until a newline
+>>>,----------[++++++++++>,----------]
+
+cell 1 = 250 (the counter)
+<[<]+++++++++++++++++++++++++[<++++++++++>-]<
+[
+    >>[.>]++++++++++.[-]<[<]<-
+]
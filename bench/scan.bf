@@ -0,0 +1,16 @@
+Scan benchmark: runs right to the end of a row of 200 non zero cells and
+back again 4000 times
+
+fill cells 3 to 202 with 1s and come back to cell 2
+++++++++++++++++++++[>>>++++++++++<<<-]
+>>>[-[->+<]+>]<[<]
+
+cell 0 = 20 (the outer counter)
+<<++++++++++++++++++++
+[
+    cell 1 = 200 (the inner counter) using cell 2 as a temporary
+    >>++++++++++[<++++++++++++++++++++>-]<
+    [>>[>]<[<]<-]
+    <-
+]
+++++++++++.
@@ -4,14 +4,50 @@
    james@incoherency.co.uk
   
    The compiler itself should be relatively portable, although the generated
-   code squarely targets CP/M. I think it only generates 8080 code (a subset
-   of Z80) but I have not tested it on anything other than a Z80.
+   code squarely targets CP/M. By default it uses Z80 instructions (ldir,
+   cpir, cpdr, jr, djnz and ix), so it will not run on an 8080 unless you
+   give the -8080 option.
   
    Compile it within CP/M using the HI-TECH C Compiler:
    C>C -V E:BFC.C
   
    Then you can compile a Brainfuck program:
    C>BFC E:HELLO.BF
+
+   Options go before the filename:
+   C>BFC -BIOS E:HELLO.BF
+
+     -8080    only use instructions that the 8080 has
+     -ELF     generate a Linux x86-64 executable called FOO instead of
+              FOO.COM, for trying programs out quickly on a PC
+     -BIOS    call the BIOS directly for console I/O, instead of the BDOS
+     -INLINE  generate console I/O code inline at each "." and ",", which is
+              slightly faster but much larger
+     -LINE    read console input a whole line at a time, so that it can be
+              edited before the program sees it, and each "," doesn't need
+              a BDOS call; the BDOS echoes each line, and the program
+              writes a '\n' after it, which also ends up in the output
+              when the input isn't typed
+     -TAPE n  only clear n bytes of tape at startup, instead of all free
+              memory; if n is 256 or less, the tape is also aligned to a
+              page, which makes pointer movement cheaper
+     -O0      don't optimise at all, for the quickest compile
+     -Os      make the generated code as small as possible, even where that
+              makes it a little slower
+     -O2      make the generated code as fast as possible, even where that
+              makes it bigger or slower to compile; this implies -INLINE;
+              if more than one -O option is given, the last one wins
+     -STATS   print some statistics about the program and the generated code
+     -PROFILE count how many times each loop body runs, and print the counts
+              (in hex) when the program exits; this turns off -EVAL
+     -SYM     also write FOO.SYM, with a label for each loop that ZSID can
+              load, and FOO.LST, which gives the address of the code for
+              each op along with where it came from in the source
+     -EVAL n  run up to about n loop iterations of the program at compile
+              time (default 1000, or 10000 with -O2, or 0 with -O0; 0 means
+              to not bother); a program that doesn't
+              read input can be run to completion this way, leaving just its
+              output
   
    And then you can execute the generated program written to E:HELLO.COM:
    C>E:HELLO
@@ -20,86 +56,595 @@
    hope you enjoy.
 */
 
+#ifdef __unix__
+#define _POSIX_C_SOURCE 1 /* for chmod(), to make -ELF output executable */
+#include <sys/stat.h>
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 
-/* We use a compile-time stack to store branch targets for loops.
+/* We use a compile-time stack to match up "[" with "]" in the parser, and
+   then again to store branch targets for loops during code generation.
 
    1024 elements of stack space is quite generous, but we don't want the memory
    for anything else so it doesn't hurt. */
 #define STACKSZ 1024
 
-/* Some global variables: */
-
-unsigned int *stack; /* stack for loop branch targets   */
-int sp;              /* index for next push on to stack */
+/* The source is read in blocks of SRC_BUFSZ bytes. On CP/M this should be a
+   multiple of the 128-byte record size; on a bigger machine you can compile
+   with a larger one to read big sources in fewer calls. */
+#ifndef SRC_BUFSZ
+#define SRC_BUFSZ 1024
+#endif
+
+/* The generated code is kept in memory until the buffer reaches PROG_WINDOW
+   bytes, after which older code is written out to the file to make room (see
+   emit()). This bounds how much memory the compiler needs no matter how big
+   the program is. */
+#ifndef PROG_WINDOW
+#define PROG_WINDOW 0x2000
+#endif
+
+/* Partial evaluation (see PARTIAL EVALUATION) runs the program on a tape of
+   EVAL_TAPESZ cells, and can collect up to EVAL_OUTSZ bytes of output. */
+#ifndef EVAL_TAPESZ
+#define EVAL_TAPESZ 0x1000
+#endif
+#ifndef EVAL_OUTSZ
+#define EVAL_OUTSZ 0x2000
+#endif
+
+/* Rather than generating code as we read the source, the parser first turns
+   the program into a list of "ops", which is our intermediate representation.
+   Having the whole program in memory at once lets us look ahead and rewrite
+   patterns before any code is generated.
+
+   Runs of "+"/"-" and of ">"/"<" are folded into a single op with a count,
+   and the two ends of every loop know the index of their partner.
+
+   Ops that operate on a cell get the cell's offset from the memory pointer in
+   "off", and any constant in "val". The parser always gives an offset of 0,
+   and the optimiser moves the pointer movement out of the way later. */
+#define OP_ADD  0 /* add val to cell off                         */
+#define OP_MOVE 1 /* add arg to the memory pointer               */
+#define OP_OUT  2 /* write cell off, or if val is 1, the byte arg,
+                     which is known to be what's in it           */
+#define OP_IN   3 /* read into cell off                          */
+#define OP_LOOP 4 /* "[": arg is the index of matching "]", and val
+                     is 1 if the cell is known not to be 0       */
+#define OP_END  5 /* "]": arg is the index of matching "[", and val
+                     is 1 if the cell is known to be 0           */
+#define OP_SET  6 /* set cell off to val                         */
+#define OP_MUL  7 /* add val times cell arg to cell off          */
+#define OP_SCAN 8 /* move by arg until the current cell is 0     */
+
+/* Each op is only 5 bytes on CP/M, so that even large programs fit in the
+   TPA alongside the generated code. Offsets are limited to what fits in a
+   signed char, which is also the range of the Z80's (ix+d) addressing. */
+struct op {
+    unsigned char type;
+    unsigned char val;
+    signed char off;
+    int arg;
+};
 
-FILE *src_fp; /* Program source code file pointer        */
-int src_char; /* The next character read from the source */
-int src_eof;  /* Set to 1 when EOF is reached            */
+/* Some global variables: */
 
+unsigned int *stack; /* stack for loop matching and branch targets */
+int sp;              /* index for next push on to stack             */
+
+struct op *ops; /* The program, as parsed                  */
+int ops_size;   /* The allocated size for the "ops" buffer */
+int nops;       /* The number of ops in the program        */
+long *op_src;   /* Source offset of each op, if track_src  */
+int *op_line;   /* Source line of each op, if track_src    */
+
+FILE *src_fp;             /* Program source code file pointer       */
+char src_buf[SRC_BUFSZ];  /* The current block of source code       */
+int src_pos;              /* Index of the next byte in src_buf      */
+int src_len;              /* Number of bytes in src_buf             */
+long src_off;             /* Source offset of the start of src_buf  */
+long tok_off;             /* Source offset of the current token     */
+int src_line;             /* Lines before src_buf[line_pos]         */
+int line_pos;             /* Index in src_buf that src_line is up to */
+int src_eof;              /* Set to 1 when EOF is reached           */
+unsigned char src_class[256]; /* Class of each byte (see TOKENISER) */
+
+int i8080;     /* Set to 1 to only use 8080 instructions             */
+int elf;       /* Set to 1 to generate an x86-64 Linux executable    */
+int bios;      /* Set to 1 to call the BIOS directly for console I/O */
+int inline_io; /* Set to 1 to inline I/O instead of calling putc/getc */
+int line_input; /* Set to 1 to read input a line at a time            */
+long tape_size; /* Bytes of tape to clear, or 0 for all of the TPA    */
+int page_tape; /* Set to 1 if the tape fits in one 256-byte page     */
+long eval_steps = -1; /* Steps to run at compile time, or -1 for default */
+int profile;   /* Set to 1 to count loop iterations                  */
+int stats;     /* Set to 1 to print statistics at the end            */
+int listing;   /* Set to 1 to write a .SYM and .LST file             */
+int track_src; /* Set to 1 to remember where each op came from       */
+int opt_level = 1; /* 0 for -O0, 2 for -O2, otherwise 1              */
+int opt_size;  /* Set to 1 by -Os to prefer smaller code over faster */
+
+FILE *out_fp;  /* Output file pointer                      */
+FILE *sym_fp;  /* Symbol file pointer, with -SYM           */
+FILE *lst_fp;  /* Listing file pointer, with -SYM          */
 char *prog;    /* Generated code goes in here              */
 int prog_size; /* The allocated size for the "prog" buffer */
+int prog_base; /* The index in the program of prog[0]      */
 int prog_idx;  /* The index for the next output byte       */
+int prog_len;  /* The length of the finished program       */
+int tape_start; /* The index in the program of the tape    */
+int op_start;  /* The index of the current op's code       */
+
+int tape_refs[4]; /* Places in prog[] that need the tape's address */
+int ntape_refs;   /* The number of entries in tape_refs[]          */
+
+int tape_adds[4]; /* What to add to the tape's address at each one  */
+
+int putc_refs; /* Chain of calls to the putc routine (see emit_call()) */
+int getc_refs; /* Chain of calls to the getc routine                   */
+
+unsigned char *eval_tape; /* The tape, as left by partial evaluation     */
+int eval_len;  /* Length of the tape up to the last non-zero cell      */
+int eval_ptr;  /* The pointer position you get to                      */
+int eval_pc;   /* The index of the op to resume from                   */
+char *eval_out; /* Output of the partial evaluation                    */
+int eval_nout; /* The number of bytes of output                        */
+int eval_outsz; /* The allocated size for the "eval_out" buffer        */
+int str_ref;   /* Where the preamble needs the address of the output   */
+
+char *str_buf; /* Strings of constant output (see emit_print())        */
+int str_len;   /* The number of bytes in str_buf                       */
+int str_size;  /* The allocated size for the "str_buf" buffer          */
+int str_refs;  /* Chain of places that need the address of a string    */
+int print_refs; /* Chain of calls to the print routine                 */
+
+int nloops;    /* The number of loops being profiled                   */
+int loop_k;    /* The number of the next loop to be generated          */
+int counters;  /* Index in the program of the loop counters            */
+int names;     /* Index in the program of the loop names               */
+int hex_refs;  /* Chain of calls to the hex routine                    */
+int scan_refs; /* Chain of calls to the scan routine (with -Os)        */
+
+int hl_off;  /* Offset of the cell that hl points at              */
+int ix_off;  /* Offset of the cell that ix points at, if ix_ok    */
+int ix_ok;   /* Set to 1 when ix_off is valid                     */
+int use_ix;  /* Set to 1 to address cells with ix in this stretch */
+int costing; /* Set to 1 to count cycles instead of emitting code */
+long cost;   /* Cycles counted while costing                      */
+long cost_bytes; /* Bytes counted while costing                   */
+#define NOWHERE 1000 /* An offset meaning "no cell" */
+
+int a_off;   /* Offset of the cell whose value is in a            */
+int z_off;   /* Offset of the cell that the Z flag is testing     */
+int keep_af; /* Set to 1 while a and the flags are still needed   */
+int keep_d;  /* Set to 1 while d is still needed                  */
+int counting; /* Depth of counted loops, which need b (see emit_countstart()) */
+int count_dec = -1; /* Index of the op that the innermost one's djnz does */
+
+/* The two CPUs take different numbers of cycles for the same instructions,
+   so for the instruction sequences that the code generator has to choose
+   between, we look the cost up in the table for the target. */
+struct timing {
+    char inc_hl; /* "inc hl" or "dec hl"              */
+    char add_hl; /* "ld bc, $n; add hl, bc"           */
+    char inc_l;  /* "inc l" or "dec l"                */
+    char add_l;  /* "ld a, l; add a, $n; ld l, a"     */
+};
+
+struct timing z80_timing = { 6, 21, 4, 15 };
+struct timing i8080_timing = { 5, 20, 5, 17 };
+struct timing *timing = &z80_timing;
+
+/* Statistics for -STATS (see STATISTICS). The code for each op is put in one
+   of three groups: arithmetic (OP_ADD, OP_SET, OP_MUL, OP_MOVE), loops
+   (OP_LOOP, OP_END, OP_SCAN), and I/O (OP_OUT, OP_IN). */
+#define NOPTYPES 9
+#define NGROUPS  3
+
+long ncmds;                 /* Brainfuck commands in the source        */
+int parsed[NOPTYPES];       /* Ops of each type straight from parse()  */
+int fast_add, slow_add;     /* emit_add() calls using inc/dec or add   */
+int fast_right, slow_right; /* emit_right() calls using inc/dec or add */
+long group_bytes[NGROUPS];  /* Code bytes generated for each group     */
+long group_cycles[NGROUPS]; /* Cycles to run that code once through    */
 
 /* FILE I/O */
 
-/* The file is read 1 byte at a time by the tokeniser, so to "load" the source
-   code we just open the specified file in src_fp, and set src_char/src_eof to
-   indicate the current state. */
+/* The file is read a block at a time by the tokeniser, so to "load" the
+   source code we just open the specified file in src_fp, and set
+   src_pos/src_len/src_eof to indicate that the buffer is empty.
+
+   It's opened in text mode, because on CP/M that stops at the ^Z that pads
+   out the last record instead of handing us whatever follows it. */
 void load(char *f) {
     src_fp = fopen(f, "r");
     if (!src_fp) {
         fprintf(stderr, "error: can't read %s\n", f);
         exit(1);
     }
-    src_char = -1;
+    src_pos = src_len = 0;
     src_eof = 0;
 }
 
-/* To save the generated program, a single fwrite() call is sufficient.
+/* The output file is created before code generation starts, because code
+   that has been pushed out of the prog buffer gets written to it as we go.
 
-   The file is opened in "wb" (write, binary) mode so that CP/M will not insert
-   0x0d bytes before any 0x0a in the output file. */
-void save(char *f) {
-    FILE *fp;
-    int wrote;
-    if (!(fp = fopen(f, "wb"))) {
+   The file is opened in "wb+" (write, binary, and also read) mode so that
+   CP/M will not insert 0x0d bytes before any 0x0a in the output file, and so
+   that we can read back code that we need to patch (see put_byte()). */
+void create(char *f) {
+    if (!(out_fp = fopen(f, "wb+"))) {
         fprintf(stderr, "error: can't write %s\n", f);
         exit(1);
     }
-    wrote = fwrite(prog, 1, prog_size, fp);
-    if (wrote != prog_size) {
-        fprintf(stderr, "error: failed to write full output (only wrote %d of %d bytes)\n", wrote, prog_size);
+}
+
+/* Write the first n bytes of the prog buffer to the end of the file, and
+   move the rest of the buffer down. */
+void flush_prog(int n) {
+    int wrote;
+    wrote = fwrite(prog, 1, n, out_fp);
+    if (wrote != n) {
+        fprintf(stderr, "error: failed to write full output (only wrote %d of %d bytes)\n", prog_base+wrote, prog_base+n);
         exit(1);
     }
-    fclose(fp);
+    memmove(prog, prog+n, prog_idx-prog_base-n);
+    prog_base += n;
+}
+
+/* To save the generated program we just flush whatever is still in the
+   buffer. */
+void save() {
+    flush_prog(prog_idx - prog_base);
+    fclose(out_fp);
+}
+
+/* MEMORY */
+
+/* Both the ops buffer and the prog buffer grow as they fill up. Each time one
+   is full we double its size, so that the total amount of copying done by
+   realloc() is proportional to the final size, instead of to its square as it
+   would be if we added a constant amount each time.
+
+   Once a buffer is 8K we only grow it by 4K at a time instead, because on
+   CP/M there isn't much memory to spare, and a 16-bit int would overflow. */
+void *grow(void *p, int *size, int elsize) {
+    if (*size < 128)
+        *size = 128;
+    else if (*size < 0x2000)
+        *size *= 2;
+    else
+        *size += 0x1000;
+    p = realloc(p, (unsigned)*size * elsize);
+    if (!p) {
+        fprintf(stderr, "error: out of memory\n");
+        exit(1);
+    }
+    return p;
 }
 
 /* CODE GENERATION */
 
+/* The code generator keeps track of what's in the registers to avoid a lot of
+   waste, but some still slips through where the code for one op meets the
+   code for the next, such as "ld d, a; ld a, d" at the start of a multiply,
+   or "ld bc, $n" when bc already holds n. So while generating code for the
+   ops (when "peep_on" is set) we also look at each instruction as it is
+   completed, and delete it, or it and the one before it, if it matches one
+   of the patterns in peeps[].
+
+   That's only safe if nothing can jump to the instruction, so anything that
+   takes the address of the next instruction as a jump target calls label(),
+   which stops us from matching anything across it. We don't delete an
+   instruction that has already been written out to the file either. */
+#define PEEP_DROP 1 /* delete the second instruction           */
+#define PEEP_BOTH 2 /* delete both instructions                */
+
+struct peep {
+    unsigned char first, second, action;
+};
+
+struct peep peeps[] = {
+    { 0x57, 0x7a, PEEP_DROP }, /* ld d, a; ld a, d          */
+    { 0x7a, 0x57, PEEP_DROP }, /* ld a, d; ld d, a          */
+    { 0x77, 0x7e, PEEP_DROP }, /* ld (hl), a; ld a, (hl)    */
+    { 0x7e, 0x77, PEEP_DROP }, /* ld a, (hl); ld (hl), a    */
+    { 0x7e, 0x7e, PEEP_DROP }, /* ld a, (hl); ld a, (hl)    */
+    { 0xb7, 0xb7, PEEP_DROP }, /* or a; or a                */
+    { 0xaf, 0xb7, PEEP_DROP }, /* xor a; or a               */
+    { 0x23, 0x2b, PEEP_BOTH }, /* inc hl; dec hl            */
+    { 0x2b, 0x23, PEEP_BOTH }, /* dec hl; inc hl            */
+    { 0, 0, 0 }
+};
+
+int peep_on;    /* Set to 1 to look for patterns              */
+int insn_at;    /* Index of the instruction being emitted     */
+int insn_op;    /* Its first byte                             */
+int insn_left;  /* Bytes of it still to come, or -1 if we only
+                   have a prefix so far                       */
+int prev_at;    /* Index of the instruction before it, or -1  */
+int bc_ok;      /* Set to 1 if bc is known to hold bc_val     */
+int bc_val;
+
+/* Say that the next instruction may be jumped to, and return its index. */
+int label() {
+    prev_at = -1;
+    bc_ok = 0;
+    return prog_idx;
+}
+
+/* Return the length of the instruction starting with "op", or 0 if it's a
+   prefix and we need to see the next byte. */
+int insn_len(int op) {
+    if (op == 0xdd || op == 0xed)
+        return 0;
+    if ((op&0xcf) == 0x01 || (op&0xe7) == 0x22 || op == 0xc3 || op == 0xcd
+            || (op&0xc7) == 0xc2 || (op&0xc7) == 0xc4)
+        return 3; /* 16-bit operand */
+    if ((op&0xc7) == 0x06 || (op&0xc7) == 0xc6 || op == 0x10 || op == 0x18
+            || (op&0xe7) == 0x20 || op == 0xd3 || op == 0xdb)
+        return 2; /* 8-bit operand */
+    return 1;
+}
+
+/* Does an instruction starting with "op" change bc? Calls do too, because
+   putc and the BDOS clobber it. */
+int changes_bc(int op) {
+    return op == 0xed || op == 0xcd || op == 0x10 || op == 0x03 || op == 0x0b
+        || op == 0xc1 || (op&0xf0) == 0x40 || op == 0x06 || op == 0x0e
+        || op == 0x04 || op == 0x05 || op == 0x0c || op == 0x0d;
+}
+
+void peep_insn() {
+    int op, prev, val, i;
+
+    op = insn_op;
+    if (insn_at < prog_base) {
+        prev_at = -1;
+        bc_ok = 0;
+        return;
+    }
+    if (op == 0x01) {
+        val = (prog[insn_at+1 - prog_base]&0xff) | (prog[insn_at+2 - prog_base]&0xff)<<8;
+        if (bc_ok && bc_val == val) {
+            prog_idx = insn_at; /* ld bc, $n with bc = n */
+            return;
+        }
+        bc_ok = 1;
+        bc_val = val;
+    } else if (changes_bc(op)) {
+        bc_ok = 0;
+    }
+
+    if (prev_at >= prog_base && insn_at == prev_at+1 && prog_idx == insn_at+1) {
+        prev = prog[prev_at - prog_base]&0xff;
+        for (i = 0; peeps[i].action; i++) {
+            if (peeps[i].first != prev || peeps[i].second != op)
+                continue;
+            if (peeps[i].action == PEEP_BOTH) {
+                /* The first one may belong to the op before, in which case
+                   this op's code now starts where it was. */
+                prog_idx = prev_at;
+                prev_at = -1;
+                if (op_start > prog_idx)
+                    op_start = prog_idx;
+            } else {
+                prog_idx = insn_at;
+            }
+            return;
+        }
+    }
+    prev_at = insn_at;
+}
+
+/* Follow the instructions through the bytes passed to emit(). */
+void peep(int c) {
+    c &= 0xff;
+    if (insn_left == 0) {
+        insn_at = prog_idx-1;
+        insn_op = c;
+        insn_left = insn_len(c);
+        if (!insn_left) {
+            insn_left = -1;
+            return;
+        }
+    } else if (insn_left == -1) {
+        /* The byte after a prefix: ed xx, dd e1/e5, dd 36 d n, or dd xx d */
+        if (insn_op == 0xed || c == 0xe1 || c == 0xe5)
+            insn_left = 1;
+        else
+            insn_left = c == 0x36 ? 3 : 2;
+    }
+    if (--insn_left == 0)
+        peep_insn();
+}
+
 /* Code generation is centred around emitting bytes into the output program.
-   We do this by first resizing the prog buffer if necessary, and then sticking
-   the new byte in it.
+   We do this by first making room in the prog buffer if necessary, and then
+   sticking the new byte in it.
 
-   A '+' is output to the console every time the buffer is reallocated, as a
-   basic progress indicator. */
+   Until the buffer is PROG_WINDOW bytes we make room by growing it. After
+   that we write the older half of it to the file instead, keeping the newer
+   half because that's what loop ends and the like are most likely to need to
+   patch.
+
+   A '+' is output to the console every time we make room, as a basic progress
+   indicator. generate() allocates enough for most programs to start with,
+   so normally there won't be many.
+
+   When "costing" is set (see below) we're only working out how expensive
+   some code would be, so nothing is emitted, but we count how many bytes it
+   would have been. */
 void emit(char c) {
-    if (prog_idx >= prog_size) {
-        prog_size += 128;
-        prog = realloc(prog, prog_size);
+    if (costing) {
+        cost_bytes++;
+        return;
+    }
+    if (prog_idx - prog_base >= prog_size) {
+        if (prog_size < PROG_WINDOW)
+            prog = grow(prog, &prog_size, 1);
+        else
+            flush_prog(prog_size/2);
         putchar('+');
     }
-    prog[prog_idx++] = c;
+    prog[prog_idx++ - prog_base] = c;
+    if (peep_on)
+        peep(c);
+}
+
+/* Read or write the byte at index "at" in the program, whether it's still in
+   the buffer or has already been written out. Going to the file is slow on
+   CP/M, but it's only needed to patch jumps over very long stretches of
+   code. */
+int get_byte(int at) {
+    int c;
+    if (at >= prog_base)
+        return prog[at - prog_base]&0xff;
+    fseek(out_fp, (long)at, SEEK_SET);
+    c = getc(out_fp);
+    fseek(out_fp, 0L, SEEK_END);
+    return c;
+}
+
+void put_byte(int at, int c) {
+    if (at >= prog_base) {
+        prog[at - prog_base] = c;
+        return;
+    }
+    fseek(out_fp, (long)at, SEEK_SET);
+    putc(c, out_fp);
+    fseek(out_fp, 0L, SEEK_END);
+}
+
+/* Patch in the address of the code at index "target" in the program, as the
+   2-byte operand at index "at".
+
+   The high byte (second byte because the Z80 is little-endian) gets 1 added
+   to it because the program will be loaded into address 0x100, which means
+   all addresses are 0x100 larger than their corresponding index. We'll see
+   this again later when generating branch target addresses for loops. */
+void patch(int at, int target) {
+    put_byte(at, target&0xff);
+    put_byte(at+1, 1+(target>>8));
+}
+
+/* Emit the address of the code at index "target" as a 2-byte operand. */
+void emit_addr(int target) {
+    emit(target&0xff);
+    emit(1+(target>>8));
+}
+
+/* Short jumps within the runtime routines and the I/O code use the Z80's
+   2-byte relative "jr", which is also 1 cycle faster than "jp" when it isn't
+   taken. The 8080 doesn't have it, so with -8080 we use "jp" instead.
+
+   "cc" is the "jr" opcode: 0x18 for "jr", 0x20 for "jr nz" and 0x28 for
+   "jr z". For "jp" these are 0xc3, 0xc2 and 0xca.
+
+   emit_jr() emits a forward jump and returns where it is, and land() points
+   it at the next instruction to be emitted.
+
+   Jumps back to the top of a loop are usually taken, so they're "jp", which
+   takes 10 cycles either way, instead of "jr", which takes 12 when it's
+   taken. With -Os it's the other way round, and we use "jr" whenever the
+   loop is short enough. */
+int jp_op(int cc) {
+    return cc == 0x18 ? 0xc3 : cc + 0xa2;
+}
+
+int emit_jr(int cc) {
+    int at;
+    at = prog_idx;
+    if (i8080) {
+        emit(jp_op(cc)); emit(0); emit(0); /* jp cc, $label */
+    } else {
+        emit(cc); emit(0);                 /* jr cc, label  */
+    }
+    return at;
+}
+
+void land(int at) {
+    if (costing)
+        return;
+    label();
+    if (i8080)
+        patch(at+1, prog_idx);
+    else
+        put_byte(at+1, prog_idx - (at+2));
+}
+
+/* Unless -INLINE is given, "." and "," don't generate the I/O code at every
+   site, but call shared putc and getc routines that are emitted once after
+   the postamble. This makes each site 3 or 4 bytes instead of 20-odd, and
+   only costs 27 cycles for the "call" and "ret".
+
+   We don't know the routines' addresses until we get to the end of the
+   program, so each "call" needs to be fixed up later. To avoid having to
+   store a list of them, we use the operand of each "call" to hold the index
+   of the previous one (0 for none), and just keep the index of the latest one
+   in a variable like putc_refs. At the end we follow the chain through the
+   program, filling in the real address as we go. */
+void emit_call(int *refs) {
+    int at;
+    emit(0xcd);                   /* call $routine */
+    at = prog_idx;
+    emit(*refs&0xff); emit(*refs>>8);
+    if (!costing)
+        *refs = at;
+}
+
+void resolve_calls(int refs) {
+    int next;
+    while (refs) {
+        next = get_byte(refs) | (get_byte(refs+1)<<8);
+        patch(refs, prog_idx);
+        refs = next;
+    }
+}
+
+/* If partial evaluation produced any output, the preamble writes it out by
+   calling putc for each byte in turn, counting them down in de. The output
+   itself is stored after the runtime routines. */
+void emit_eval_output() {
+    int loop;
+    emit(0x21);                   /* ld hl, $str        */
+    str_ref = prog_idx;
+    emit(0); emit(0);
+    emit(0x11); emit(eval_nout&0xff); emit(eval_nout>>8); /* ld de, $n */
+    loop = prog_idx;
+    emit(0x7e);                   /* loop: ld a, (hl)   */
+    emit(0xd5);                   /* push de            */
+    emit_call(&putc_refs);        /* call putc          */
+    emit(0xd1);                   /* pop de             */
+    emit(0x23);                   /* inc hl             */
+    emit(0x1b);                   /* dec de             */
+    emit(0x7a);                   /* ld a, d            */
+    emit(0xb3);                   /* or e               */
+    emit(0xc2); emit_addr(loop);  /* jp nz, loop        */
 }
 
 /* The preamble goes at the very start of our generated program. It first
    zeroes out RAM starting at the end of the generated code and finishing at
    the byte before the start of the BDOS. CP/M stores the BDOS start address in
-   address 0x0006 (thanks Graham!) so we copy the address from 0x0006 into the
-   bc register pair, initialise hl to point just past the end of our generated
-   program, and then loop up zeroing out the address in hl, until hl equals bc.
+   address 0x0006 (thanks Graham!) so we subtract the address just past the end
+   of our generated program from it to get the number of bytes to clear.
+
+   Rather than storing 0 in each byte in a loop, we store a single 0 in the
+   first byte and have "ldir" copy it forwards: ldir copies from hl to de,
+   so with de one ahead of hl each byte it writes is the 0 it just copied. This
+   costs 21 cycles per byte, which is about half of what the loop cost, and
+   clearing ~50K still takes about a second at 1MHz, which is why -TAPE lets
+   you give a smaller size to clear instead. The 8080 doesn't have ldir, so
+   with -8080 we're back to the loop, counting bytes down in bc.
+
+   Then we write out any output from partial evaluation, and point hl at the
+   current cell. Finally we load the cell into a and test it, because the
+   code generator likes to know that a and the Z flag both match the current
+   cell when the program starts. Usually the cell is 0, so clearing a does
+   both.
 
    As part of this, we will zero out the CCP, but this is fine because it gets
    restored by the BDOS when we jump to address 0 at the end.
@@ -112,47 +657,451 @@ void emit(char c) {
    |  Zero page  |                   Transient Program Area                   | CCP | BDOS | BIOS |
    +-------------+------------------------------------------------------------+-------------------+
 
-   Note there is no bounds-checking on memory accesses.
+   Note there is no bounds-checking on memory accesses, and with -TAPE memory
+   beyond the first n bytes is left as it was.
 
-   We can't yet generate bytes for $prog_size because we don't know how large
+   We can't yet generate bytes for $prog_len because we don't know how large
    the program will end up being, so we emit 0s for now, which will be
-   corrected later. */
+   corrected later. emit_tape_addr() remembers where they are, and what
+   needs adding to the address, which is the offset of a cell in the tape. */
+void emit_tape_addr(int add) {
+    tape_adds[ntape_refs] = add;
+    tape_refs[ntape_refs++] = prog_idx;
+    emit(0); emit(0);
+}
+
+/* In -BIOS mode, console I/O calls the BIOS CONOUT and CONIN routines
+   directly, which avoids the BDOS's dispatch overhead, and its echoing and
+   ^S/^C handling. The BIOS can be anywhere in memory, but address 0x0001
+   always holds the address of its warm boot entry point, BIOS+3, and the jump
+   table that follows it has CONIN at BIOS+9 and CONOUT at BIOS+12.
+
+   So the program starts with two jump instructions of its own at fixed
+   addresses, and the preamble fills in their targets from the BIOS jump
+   table. Then the generated code can just "call CONOUT" or "call CONIN". */
+#define CONOUT 0x103
+#define CONIN  0x106
+
+void emit_bios_vectors() {
+    emit(0xc3); emit(9); emit(1);       /* jp start         */
+    emit(0xc3); emit(0); emit(0);       /* conout: jp $bios */
+    emit(0xc3); emit(0); emit(0);       /* conin: jp $bios  */
+    emit(0x2a); emit(1); emit(0);       /* start: ld hl, (1) */
+    emit(0x11); emit(6); emit(0);       /* ld de, 6         */
+    emit(0x19);                         /* add hl, de       */
+    emit(0x22); emit((CONIN+1)&0xff); emit((CONIN+1)>>8);   /* ld (conin+1), hl  */
+    emit(0x23);                         /* inc hl           */
+    emit(0x23);                         /* inc hl           */
+    emit(0x23);                         /* inc hl           */
+    emit(0x22); emit((CONOUT+1)&0xff); emit((CONOUT+1)>>8); /* ld (conout+1), hl */
+}
+
 void emit_preamble() {
-    emit(0x26); emit(0);          /* ld h, 0 */
-    emit(0x2e); emit(6);          /* ld l, 6 */
-    emit(0x4e);                   /* ld c, (hl) */
-    emit(0x23);                   /* inc hl */
-    emit(0x46);                   /* ld b, (hl) */
-    emit(0x21); emit(0); emit(0); /* ld hl, $prog_size */
-    emit(0x36); emit(0);          /* loop: ld (hl), 0 */
-    emit(0x23);                   /* inc hl */
-    emit(0x7c);                   /* ld a, h */
-    emit(0x90);                   /* sub b */
-    emit(0x57);                   /* ld d, a */
-    emit(0x7d);                   /* ld a, l */
-    emit(0x91);                   /* sub c */
-    emit(0xb2);                   /* or d */
-    emit(0x20); emit(0xf5);       /* jr nz loop */
-    emit(0x21); emit(0); emit(0); /* ld hl, $prog_size */
+    long n, c;
+    int loop;
+    if (bios)
+        emit_bios_vectors();
+
+    /* If partial evaluation left anything on the tape, it's part of the .COM
+       file (see emit_postamble()), so we only clear the tape after it. */
+    n = tape_size - eval_len;
+    emit(0x21); emit_tape_addr(eval_len); /* ld hl, $prog_len+eval_len */
+    if (!tape_size) {
+        emit(0x3a); emit(6); emit(0); /* ld a, (6) */
+        emit(0x95);               /* sub l */
+        emit(0x4f);               /* ld c, a */
+        emit(0x3a); emit(7); emit(0); /* ld a, (7) */
+        emit(0x9c);               /* sbc a, h */
+        emit(0x47);               /* ld b, a */
+        if (!i8080)
+            emit(0x0b);           /* dec bc */
+    } else if (n > 1) {
+        c = i8080 ? n : n-1;      /* ldir copies 1 fewer */
+        emit(0x01); emit(c&0xff); emit(c>>8); /* ld bc, $c */
+    }
+    if (i8080 && (!tape_size || n > 1)) {
+        loop = prog_idx;
+        emit(0x36); emit(0);      /* loop: ld (hl), 0 */
+        emit(0x23);               /* inc hl */
+        emit(0x0b);               /* dec bc */
+        emit(0x78);               /* ld a, b */
+        emit(0xb1);               /* or c */
+        emit(0xc2); emit_addr(loop); /* jp nz, loop */
+    } else if (!tape_size || n > 1) {
+        emit(0x54);               /* ld d, h */
+        emit(0x5d);               /* ld e, l */
+        emit(0x13);               /* inc de */
+        emit(0x36); emit(0);      /* ld (hl), 0 */
+        emit(0xed); emit(0xb0);   /* ldir */
+    } else if (n == 1) {
+        emit(0x36); emit(0);      /* ld (hl), 0 */
+    }
+
+    if (eval_nout)
+        emit_eval_output();
+
+    emit(0x21); emit_tape_addr(eval_ptr); /* ld hl, $prog_len+eval_ptr */
+    if (eval_pc < nops && eval_tape[eval_ptr]) {
+        emit(0x7e);               /* ld a, (hl) */
+        emit(0xb7);               /* or a */
+    } else {
+        emit(0xaf);               /* xor a */
+    }
 }
 
-/* The postamble goes at the very end of our generated program. All it does
-   is jump to address 0 which returns control to the CCP.
+/* putc writes the byte in a to the console, translating '\n' to "\r\n" as
+   before. It preserves hl, which is all the generated code cares about. */
+void emit_putc() {
+    int label;
+    resolve_calls(putc_refs);
+    emit(0xe5);                   /* putc: push hl     */
+    if (bios) {
+        emit(0xfe); emit('\n');   /* cp '\n'           */
+        label = emit_jr(0x20);    /* jr nz, label      */
+        emit(0xf5);               /* push af           */
+        emit(0x0e); emit('\r');   /* ld c, '\r'        */
+        emit(0xcd); emit(CONOUT&0xff); emit(CONOUT>>8); /* call conout */
+        emit(0xf1);               /* pop af            */
+        land(label);
+        emit(0x4f);               /* label: ld c, a    */
+        emit(0xcd); emit(CONOUT&0xff); emit(CONOUT>>8); /* call conout */
+    } else {
+        emit(0x5f);               /* ld e, a           */
+        emit(0xfe); emit('\n');   /* cp '\n'           */
+        label = emit_jr(0x20);    /* jr nz, label      */
+        emit(0xd5);               /* push de           */
+        emit(0x1e); emit('\r');   /* ld e, '\r'        */
+        emit(0x0e); emit(2);      /* ld c, 2           */
+        emit(0xcd); emit(5); emit(0); /* call 5        */
+        emit(0xd1);               /* pop de            */
+        land(label);
+        emit(0x0e); emit(2);      /* label: ld c, 2    */
+        emit(0xcd); emit(5); emit(0); /* call 5        */
+    }
+    emit(0xe1);                   /* pop hl            */
+    emit(0xc9);                   /* ret               */
+}
 
-   Having written the "jp 0" instruction, we can now patch in the correct
-   values for $prog_size in the preamble.
+/* getc reads a byte from the console in to a, skipping a '\r', and again
+   preserves hl. */
+void emit_getc() {
+    int label;
+    resolve_calls(getc_refs);
+    emit(0xe5);                   /* getc: push hl     */
+    if (bios) {
+        emit(0xcd); emit(CONIN&0xff); emit(CONIN>>8); /* call conin */
+        emit(0xfe); emit('\r');   /* cp '\r'           */
+        label = emit_jr(0x20);    /* jr nz, label      */
+        emit(0xcd); emit(CONIN&0xff); emit(CONIN>>8); /* call conin */
+    } else {
+        emit(0x0e); emit(1);      /* ld c, 1           */
+        emit(0xcd); emit(5); emit(0); /* call 5        */
+        emit(0xfe); emit('\r');   /* cp '\r'           */
+        label = emit_jr(0x20);    /* jr nz, label      */
+        emit(0x0e); emit(1);      /* ld c, 1           */
+        emit(0xcd); emit(5); emit(0); /* call 5        */
+    }
+    land(label);
+    emit(0xe1);                   /* label: pop hl     */
+    emit(0xc9);                   /* ret               */
+}
+
+/* hex writes the 4 bytes ending at hl to the console as 8 hex digits,
+   most significant first, followed by "\r\n". It's only used for -PROFILE,
+   so it doesn't bother with the BIOS. The digit routine that it uses goes
+   first, so that we know its address. */
+void emit_hex() {
+    int digit, loop;
+    digit = prog_idx;
+    emit(0xe6); emit(0x0f);       /* digit: and 0x0f   */
+    emit(0xc6); emit(0x90);       /* add a, 0x90       */
+    emit(0x27);                   /* daa               */
+    emit(0xce); emit(0x40);       /* adc a, 0x40       */
+    emit(0x27);                   /* daa               */
+    emit(0x5f);                   /* ld e, a           */
+    emit(0x0e); emit(2);          /* ld c, 2           */
+    emit(0xc3); emit(5); emit(0); /* jp 5              */
 
-   The high byte of $prog_size (second byte because the Z80 is little-endian)
-   gets 1 added to it because the program will be loaded into address 0x100,
-   which means all addresses are 0x100 larger than their corresponding
-   index in prog[]. We'll see this again later when generating branch target
-   addresses for loops. */
+    resolve_calls(hex_refs);
+    emit(0x06); emit(4);          /* hex: ld b, 4      */
+    loop = prog_idx;
+    emit(0x7e);                   /* loop: ld a, (hl)  */
+    emit(0xe5);                   /* push hl           */
+    emit(0xc5);                   /* push bc           */
+    emit(0xf5);                   /* push af           */
+    emit(0x0f); emit(0x0f); emit(0x0f); emit(0x0f); /* rrca x 4 */
+    emit(0xcd); emit_addr(digit); /* call digit        */
+    emit(0xf1);                   /* pop af            */
+    emit(0xcd); emit_addr(digit); /* call digit        */
+    emit(0xc1);                   /* pop bc            */
+    emit(0xe1);                   /* pop hl            */
+    emit(0x2b);                   /* dec hl            */
+    if (i8080) {
+        emit(0x05);               /* dec b             */
+        emit(0xc2); emit_addr(loop); /* jp nz, loop    */
+    } else {
+        emit(0x10); emit(loop - (prog_idx+1)); /* djnz loop */
+    }
+    emit(0x1e); emit('\r');       /* ld e, '\r'        */
+    emit(0x0e); emit(2);          /* ld c, 2           */
+    emit(0xcd); emit(5); emit(0); /* call 5            */
+    emit(0x1e); emit('\n');       /* ld e, '\n'        */
+    emit(0x0e); emit(2);          /* ld c, 2           */
+    emit(0xc3); emit(5); emit(0); /* jp 5              */
+}
+
+/* With -LINE, getc reads a whole line at a time in to a buffer with BDOS
+   call 10, and then hands out a byte from it each time it's called, with a
+   '\n' on the end in place of the return key. The buffer starts with its
+   size and then the number of bytes read, and it goes in the 128 bytes at
+   0x80, which CP/M leaves free for the program. That leaves room for 125
+   bytes and the '\n'.
+
+   The BDOS echoes the line as it's typed, finishing with a '\r', so we write
+   a '\n' to go on to the next line. CP/M can't tell us whether anyone is
+   typing, so the '\n' is written even when the input comes from somewhere
+   else, like a SUBMIT file or z80emu, and then it's an extra byte of output
+   after each line that the program didn't write itself. The number of bytes left, and the
+   address of the next one, are stored just before the routine. */
+#define LINEBUF 0x80
+
+void emit_getline() {
+    int left, next, have;
+
+    left = prog_idx;
+    emit(0);                      /* left: db 0        */
+    next = prog_idx;
+    emit(0); emit(0);             /* next: dw 0        */
+
+    resolve_calls(getc_refs);
+    emit(0xe5);                   /* getc: push hl     */
+    emit(0x3a); emit_addr(left);  /* ld a, (left)      */
+    emit(0xb7);                   /* or a              */
+    have = emit_jr(0x20);         /* jr nz, have       */
+    emit(0x11); emit(LINEBUF); emit(0); /* ld de, LINEBUF */
+    emit(0x3e); emit(125);        /* ld a, 125         */
+    emit(0x12);                   /* ld (de), a        */
+    emit(0x0e); emit(10);         /* ld c, 10          */
+    emit(0xcd); emit(5); emit(0); /* call 5            */
+    emit(0x1e); emit('\n');       /* ld e, '\n'        */
+    emit(0x0e); emit(2);          /* ld c, 2           */
+    emit(0xcd); emit(5); emit(0); /* call 5            */
+    emit(0x21); emit(LINEBUF+1); emit(0); /* ld hl, LINEBUF+1 */
+    emit(0x7e);                   /* ld a, (hl)        */
+    emit(0x23);                   /* inc hl            */
+    emit(0x22); emit_addr(next);  /* ld (next), hl     */
+    emit(0x5f);                   /* ld e, a           */
+    emit(0x16); emit(0);          /* ld d, 0           */
+    emit(0x19);                   /* add hl, de        */
+    emit(0x36); emit('\n');       /* ld (hl), '\n'     */
+    emit(0x3c);                   /* inc a             */
+    land(have);
+    emit(0x3d);                   /* have: dec a       */
+    emit(0x32); emit_addr(left);  /* ld (left), a      */
+    emit(0x2a); emit_addr(next);  /* ld hl, (next)     */
+    emit(0x7e);                   /* ld a, (hl)        */
+    emit(0x23);                   /* inc hl            */
+    emit(0x22); emit_addr(next);  /* ld (next), hl     */
+    emit(0xe1);                   /* pop hl            */
+    emit(0xc9);                   /* ret               */
+}
+
+/* print writes the '$'-terminated string at de to the console, and
+   preserves hl (see emit_print()). With -BIOS it has to do that a byte at a
+   time. */
+void emit_print_routine() {
+    int loop, done;
+    resolve_calls(print_refs);
+    emit(0xe5);                   /* print: push hl    */
+    if (bios) {
+        emit(0xeb);               /* ex de, hl         */
+        loop = prog_idx;
+        emit(0x7e);               /* loop: ld a, (hl)  */
+        emit(0xfe); emit('$');    /* cp '$'            */
+        done = emit_jr(0x28);     /* jr z, done        */
+        emit(0xe5);               /* push hl           */
+        emit(0x4f);               /* ld c, a           */
+        emit(0xcd); emit(CONOUT&0xff); emit(CONOUT>>8); /* call conout */
+        emit(0xe1);               /* pop hl            */
+        emit(0x23);               /* inc hl            */
+        emit(0xc3); emit_addr(loop); /* jp loop        */
+        land(done);
+    } else {
+        emit(0x0e); emit(9);      /* ld c, 9           */
+        emit(0xcd); emit(5); emit(0); /* call 5        */
+    }
+    emit(0xe1);                   /* done: pop hl      */
+    emit(0xc9);                   /* ret               */
+}
+
+/* scan moves hl by de until it points at a 0, for OP_SCAN with -Os (see
+   emit_scan()). It returns with a = 0 and the Z flag set. */
+void emit_scan_routine() {
+    int loop;
+    resolve_calls(scan_refs);
+    emit(0x7e);                   /* scan: ld a, (hl)  */
+    emit(0xb7);                   /* or a              */
+    emit(0xc8);                   /* ret z             */
+    loop = prog_idx;
+    emit(0x19);                   /* loop: add hl, de  */
+    emit(0x7e);                   /* ld a, (hl)        */
+    emit(0xb7);                   /* or a              */
+    if (i8080) {
+        emit(0xc2); emit_addr(loop); /* jp nz, loop    */
+    } else {
+        emit(0x20); emit(loop - (prog_idx+1)); /* jr nz, loop */
+    }
+    emit(0xc9);                   /* ret               */
+}
+
+/* Emit whichever of the runtime routines have been used. */
+void emit_runtime() {
+    if (putc_refs)
+        emit_putc();
+    if (getc_refs && line_input)
+        emit_getline();
+    else if (getc_refs)
+        emit_getc();
+    if (hex_refs)
+        emit_hex();
+    if (scan_refs)
+        emit_scan_routine();
+    if (print_refs)
+        emit_print_routine();
+}
+
+/* The strings for emit_print() go after everything else. They're in the
+   same order as the places that need their addresses, and the chain of
+   those goes backwards from the last one, so we find each string by working
+   back from the end to the '$' before it. */
+void emit_strings() {
+    int i, base, start, next;
+    base = prog_idx;
+    for (i = 0; i < str_len; i++)
+        emit(str_buf[i]);
+    while (str_refs) {
+        next = get_byte(str_refs) | (get_byte(str_refs+1)<<8);
+        for (start = i-1; start > 0 && str_buf[start-1] != '$'; start--);
+        patch(str_refs, base + start);
+        i = start;
+        str_refs = next;
+    }
+}
+
+/* With -PROFILE, each loop gets a 32-bit counter that is incremented at the
+   top of its body, so it counts how many times the body ran. When the
+   program exits, it writes out a line for each loop giving its offset in the
+   source file and the count, so that you can tell which loops are worth
+   working on.
+
+   The counters and the text for each line go in a table right after the
+   preamble, with a "jp" over it, because then we know where everything is
+   when we generate the code that refers to it. */
+void loop_name(char *buf, int i) {
+    sprintf(buf, "loop at %ld: $", op_src[i]);
+}
+
+void emit_profile_table() {
+    int i;
+    char *p, buf[32];
+
+    for (i = nloops = 0; i < nops; i++)
+        if (ops[i].type == OP_LOOP)
+            nloops++;
+    if (!nloops)
+        return;
+
+    emit(0xc3); emit(0); emit(0); /* jp $over */
+    counters = prog_idx;
+    for (i = 0; i < 4*nloops; i++)
+        emit(0);
+    names = prog_idx;
+    for (i = 0; i < nops; i++) {
+        if (ops[i].type == OP_LOOP) {
+            loop_name(buf, i);
+            for (p = buf; *p; p++)
+                emit(*p);
+        }
+    }
+    patch(counters-2, prog_idx);
+}
+
+/* Increment the counter for the next loop, without disturbing hl. If the low
+   16 bits wrap around to 0, we increment the high 16 bits too. */
+void emit_count() {
+    int c, done;
+    c = counters + 4*loop_k++;
+    emit(0xe5);                   /* push hl         */
+    emit(0x2a); emit_addr(c);     /* ld hl, ($c)     */
+    emit(0x23);                   /* inc hl          */
+    emit(0x22); emit_addr(c);     /* ld ($c), hl     */
+    emit(0x7c);                   /* ld a, h         */
+    emit(0xb5);                   /* or l            */
+    done = emit_jr(0x20);         /* jr nz, done     */
+    emit(0x2a); emit_addr(c+2);   /* ld hl, ($c+2)   */
+    emit(0x23);                   /* inc hl          */
+    emit(0x22); emit_addr(c+2);   /* ld ($c+2), hl   */
+    land(done);
+    emit(0xe1);                   /* done: pop hl    */
+    a_off = z_off = NOWHERE;
+}
+
+/* Write out the line for each loop, using BDOS call 9 for the text. */
+void emit_profile_dump() {
+    int i, k, name;
+    char buf[32];
+
+    name = names;
+    for (i = k = 0; i < nops; i++) {
+        if (ops[i].type != OP_LOOP)
+            continue;
+        emit(0x11); emit_addr(name);  /* ld de, $name  */
+        emit(0x0e); emit(9);          /* ld c, 9       */
+        emit(0xcd); emit(5); emit(0); /* call 5        */
+        emit(0x21); emit_addr(counters + 4*k++ + 3); /* ld hl, $counter+3 */
+        emit_call(&hex_refs);         /* call hex      */
+        loop_name(buf, i);
+        name += strlen(buf);
+    }
+}
+
+/* The postamble goes at the very end of our generated program. All it does
+   is jump to address 0 which returns control to the CCP, after writing out
+   the loop counts if we're profiling. It's followed by any
+   runtime routines that the program uses, and the output of partial
+   evaluation.
+
+   Having written the "jp 0" instruction, we know how long the program is.
+   We pad it with zeroes to a whole number of 128-byte records, so that the
+   tape starts immediately after the end of the .COM file, and can now patch
+   in the correct values for $prog_len in the preamble. Then any non-zero
+   part of the tape left by partial evaluation goes on the end, so that CP/M
+   loads it straight in to place.
+
+   A page-aligned tape starts at the next multiple of 256 instead. The gap
+   only needs filling in the file if there is a tape image to follow it. */
 void emit_postamble() {
+    int i;
+    if (profile)
+        emit_profile_dump();
     emit(0xc3); emit(0); emit(0); /* jp 0 */
-    prog[8] = prog_size&0xff;
-    prog[9] = 1+(prog_size>>8);
-    prog[22] = prog_size&0xff;
-    prog[23] = 1+(prog_size>>8);
+    emit_runtime();
+    if (eval_nout) {
+        patch(str_ref, prog_idx);
+        for (i = 0; i < eval_nout; i++)
+            emit(eval_out[i]);
+    }
+    emit_strings();
+    prog_len = (prog_idx+127) & ~127;
+    tape_start = page_tape ? (prog_len+255) & ~255 : prog_len;
+    if (eval_len)
+        prog_len = tape_start;
+    while (prog_idx < prog_len)
+        emit(0);
+    for (i = 0; i < ntape_refs; i++)
+        patch(tape_refs[i], tape_start + tape_adds[i]);
+    for (i = 0; i < eval_len; i++)
+        emit(eval_tape[i]);
 }
 
 /* We use BDOS call number 1 to request a byte of input from the console.
@@ -166,19 +1115,53 @@ void emit_postamble() {
 
    In the event that we received a '\r', we throw it away and ask for another
    byte, because CP/M gives us '\r\n' line endings and Brainfuck expects just
-   '\n'. */
+   '\n'.
+
+   In -BIOS mode we call CONIN instead, which also returns the character in
+   a, but doesn't echo it back to the console. */
+void emit_bios_input() {
+    int label;
+    emit(0xe5);                   /* push hl           */
+    emit(0xcd); emit(CONIN&0xff); emit(CONIN>>8); /* call conin */
+    emit(0xe1);                   /* pop hl            */
+    emit(0xfe); emit('\r');       /* cp '\r'           */
+    label = emit_jr(0x20);        /* jr nz, label      */
+    emit(0xe5);                   /* push hl           */
+    emit(0xcd); emit(CONIN&0xff); emit(CONIN>>8); /* call conin */
+    emit(0xe1);                   /* pop hl            */
+    land(label);
+    emit(0x77);                   /* label: ld (hl), a */
+}
+
 void emit_input() {
+    int label;
+    if (!inline_io || line_input) {
+        emit_call(&getc_refs);    /* call getc         */
+        emit(0x77);               /* ld (hl), a        */
+        a_off = hl_off;
+        z_off = NOWHERE;
+        return;
+    }
+    if (bios) {
+        emit_bios_input();
+        a_off = hl_off;
+        z_off = NOWHERE;
+        return;
+    }
     emit(0x0e); emit(1);          /* ld c, 1           */
     emit(0xe5);                   /* push hl           */
     emit(0xcd); emit(5); emit(0); /* call 5            */
     emit(0xe1);                   /* pop hl            */
     emit(0xfe); emit('\r');       /* cp '\r'           */
-    emit(0x20); emit(9);          /* jr nz, label      */
+    label = emit_jr(0x20);        /* jr nz, label      */
     emit(0x0e); emit(1);          /* ld c, 1           */
     emit(0xe5);                   /* push hl           */
     emit(0xcd); emit(5); emit(0); /* call 5            */
     emit(0xe1);                   /* pop hl            */
+    land(label);
     emit(0x77);                   /* label: ld (hl), a */
+    a_off = hl_off;
+    z_off = NOWHERE;
 }
 
 /* We use BDOS call number 2 to write a byte to the console.
@@ -188,16 +1171,98 @@ void emit_input() {
    after, the BDOS call because it gets clobbered.
 
    In the event that the program tries to write a '\n', we make sure to first
-   write a '\r' so that the carriage is returned to the start of the line. */
+   write a '\r' so that the carriage is returned to the start of the line.
+
+   The first instruction can be skipped if a already holds the cell.
+
+   In -BIOS mode we call CONOUT instead, which takes the byte in c. */
+void emit_bios_output() {
+    int label;
+    emit(0xfe); emit('\n');       /* cp '\n'           */
+    label = emit_jr(0x20);        /* jr nz, label      */
+    emit(0x0e); emit('\r');       /* ld c, '\r'        */
+    emit(0xe5);                   /* push hl           */
+    emit(0xcd); emit(CONOUT&0xff); emit(CONOUT>>8); /* call conout */
+    emit(0xe1);                   /* pop hl            */
+    land(label);
+    emit(0x4e);                   /* label: ld c, (hl) */
+    emit(0xe5);                   /* push hl           */
+    emit(0xcd); emit(CONOUT&0xff); emit(CONOUT>>8); /* call conout */
+    emit(0xe1);                   /* pop hl            */
+}
+
+/* known_values() marks an OP_OUT whose byte it knows, and moves each one up
+   next to the one before it, if there's nothing in between except ops that
+   only change the tape, which can't tell the difference. So all the code
+   generator sees of some constant output is a run of marked ops, and we can
+   write the whole run with one call to BDOS function 9, which writes out a
+   string ending in '$', instead of a call per byte. That's why a '$' is
+   never marked.
+
+   The string, with '\n' already turned in to "\r\n", is added to str_buf,
+   and emit_strings() writes them all out at the end. The "ld de" to load its
+   address uses its operand for a chain, in the same way as emit_call().
+   The BDOS call is in a shared print routine unless -INLINE is given.
+
+   Returns the index of the last op in the run. */
+void str_byte(int c) {
+    if (str_len >= str_size)
+        str_buf = grow(str_buf, &str_size, 1);
+    str_buf[str_len++] = c;
+}
+
+int emit_print(int i) {
+    int at;
+
+    for (; i < nops && ops[i].type == OP_OUT && ops[i].val; i++) {
+        if (costing)
+            continue;
+        if (ops[i].arg == '\n')
+            str_byte('\r');
+        str_byte(ops[i].arg);
+    }
+    if (!costing)
+        str_byte('$');
+
+    if (inline_io && !bios)
+        emit(0xe5);               /* push hl           */
+    emit(0x11);                   /* ld de, $str       */
+    at = prog_idx;
+    emit(str_refs&0xff); emit(str_refs>>8);
+    if (!costing)
+        str_refs = at;
+    if (inline_io && !bios) {
+        emit(0x0e); emit(9);      /* ld c, 9           */
+        emit(0xcd); emit(5); emit(0); /* call 5        */
+        emit(0xe1);               /* pop hl            */
+    } else {
+        emit_call(&print_refs);   /* call print        */
+    }
+    a_off = z_off = NOWHERE;
+    return i-1;
+}
+
 void emit_output() {
-    emit(0x7e);                   /* ld a, (hl)        */
+    int label;
+    if (a_off != hl_off)
+        emit(0x7e);               /* ld a, (hl)        */
+    a_off = z_off = NOWHERE;
+    if (!inline_io) {
+        emit_call(&putc_refs);    /* call putc         */
+        return;
+    }
+    if (bios) {
+        emit_bios_output();
+        return;
+    }
     emit(0xfe); emit('\n');       /* cp '\n'           */
-    emit(0x20); emit(9);          /* jr nz, label      */
+    label = emit_jr(0x20);        /* jr nz, label      */
     emit(0x1e); emit('\r');       /* ld e, '\r'        */
     emit(0x0e); emit(2);          /* ld c, 2           */
     emit(0xe5);                   /* push hl           */
     emit(0xcd); emit(5); emit(0); /* call 5            */
     emit(0xe1);                   /* pop hl            */
+    land(label);
     emit(0x5e);                   /* label: ld e, (hl) */
     emit(0x0e); emit(2);          /* ld c, 2           */
     emit(0xe5);                   /* push hl           */
@@ -205,6 +1270,143 @@ void emit_output() {
     emit(0xe1);                   /* pop hl            */
 }
 
+/* Ops address cells by their offset from the memory pointer, so during code
+   generation we keep track of where hl actually points, relative to the
+   memory pointer, in hl_off. hl only has to agree with the memory pointer
+   at the loop boundaries, where the loop test looks at (hl), so in between
+   we can leave it wherever it was last used.
+
+   On the Z80 we also have the option of addressing a cell as (ix+d), which
+   saves moving hl back and forth to visit cells at different offsets, but
+   costs 12 extra cycles per access compared to (hl). When ix_ok is set, ix
+   points at the cell at offset ix_off. ix is never relied on across a loop
+   boundary or a BDOS call.
+
+   Whether it's worth using ix depends on the particular code, so for each
+   stretch of code between loop boundaries we generate it twice with
+   "costing" set, once with use_ix and once without, and count up the cycles
+   that differ between the two (pointer movement, ix setup, and the extra cost
+   of (ix+d)) in "cost". Then we generate it for real with whichever was
+   cheaper. */
+
+/* We also keep track of what's in the a register and the flags, so that we
+   can avoid reloading and retesting a cell that we already have. a_off is the
+   offset of the cell whose value is known to be in a, and z_off is the offset
+   of the cell that the Z flag is known to reflect (set if the cell is 0).
+   Either can be NOWHERE if we don't know. For example, "ld a, (hl); add a, n;
+   ld (hl), a" leaves both a_off and z_off at the cell's offset, and "inc (hl)"
+   sets just z_off.
+
+   The 16-bit instructions we use for moving hl or setting up ix don't affect
+   a or the Z flag, but the 8-bit ones used with a page-aligned tape do (see
+   emit_right()), and BDOS calls clobber both. */
+
+/* Forget anything we knew about the cell at offset "off", because it's about
+   to be written. */
+void clobber(int off) {
+    if (a_off == off) a_off = NOWHERE;
+    if (z_off == off) z_off = NOWHERE;
+}
+
+/* ">" and "<" are implemented in terms of emit_right(), which moves hl.
+
+   Again we support changing the memory pointer by more than 1 at a time.
+
+   As a micro-optimisation, we revert to "inc hl" and "dec hl" when that's
+   cheaper, which on both CPUs is when changing the value by 3 or less: these
+   execute in only 6 clock cycles (5 on the 8080), compared to 21 cycles (20)
+   for arbitrary changes.
+
+   Inside a counted loop b holds the count, so the arbitrary change is done
+   with de instead, unless a multiply is using d, in which case we have to
+   save bc around it.
+
+   When the tape fits in a single page, only l ever needs to change, and "inc
+   l" and "dec l" take just 4 cycles (5), or "ld a, l; add a, $n; ld l, a"
+   takes 15 cycles (17) for anything bigger. But they change the Z flag, and
+   the latter changes a as well, so we only use them when we don't know of
+   anything useful in there already. */
+void emit_right(int n) {
+    int k;
+
+    if (n == 0)
+        return;
+    k = n < 0 ? -n : n;
+    if (page_tape && z_off == NOWHERE && !keep_af) {
+        if (k*timing->inc_l < timing->add_l) {
+            if (!costing) fast_right++;
+            cost += k*timing->inc_l;
+            for (; n < 0; n++) emit(0x2d);    /* dec l      */
+            for (; n > 0; n--) emit(0x2c);    /* inc l      */
+            return;
+        }
+        if (a_off == NOWHERE) {
+            if (!costing) slow_right++;
+            cost += timing->add_l;
+            emit(0x7d);                       /* ld a, l    */
+            emit(0xc6); emit(n&0xff);         /* add a, $n  */
+            emit(0x6f);                       /* ld l, a    */
+            return;
+        }
+    }
+    if (k*timing->inc_hl < timing->add_hl) {
+        if (!costing) fast_right++;
+        cost += k*timing->inc_hl;
+        for (; n < 0; n++) emit(0x2b);        /* dec hl     */
+        for (; n > 0; n--) emit(0x23);        /* inc hl     */
+    } else if (!counting) {
+        if (!costing) slow_right++;
+        cost += timing->add_hl;
+        emit(0x01); emit(n&0xff); emit(n>>8); /* ld bc, $n  */
+        emit(0x09);                           /* add hl, bc */
+    } else if (!keep_d) {
+        if (!costing) slow_right++;
+        cost += timing->add_hl;
+        emit(0x11); emit(n&0xff); emit(n>>8); /* ld de, $n  */
+        emit(0x19);                           /* add hl, de */
+    } else {
+        if (!costing) slow_right++;
+        cost += timing->add_hl + 21;
+        emit(0xc5);                           /* push bc    */
+        emit(0x01); emit(n&0xff); emit(n>>8); /* ld bc, $n  */
+        emit(0x09);                           /* add hl, bc */
+        emit(0xc1);                           /* pop bc     */
+    }
+}
+
+/* Move hl to point at the cell at offset "off". */
+void emit_at(int off) {
+    emit_right(off - hl_off);
+    hl_off = off;
+}
+
+/* Emit an instruction that operates on the cell at offset "off". "op" is the
+   opcode for the (hl) form of the instruction; for the (ix+d) form, the same
+   opcode gets a 0xdd prefix and is followed by the displacement, so any
+   immediate operand can be emitted after this in either case.
+
+   If hl already points at the cell then (hl) is always best. Otherwise we use
+   (ix+d) if we've decided to for this stretch, setting ix from hl first if
+   necessary, and if not we move hl to the cell. */
+void emit_cell(unsigned char op, int off) {
+    if (off != hl_off && use_ix) {
+        if (!ix_ok || off - ix_off < -128 || off - ix_off > 127) {
+            emit(0xe5);             /* push hl */
+            emit(0xdd); emit(0xe1); /* pop ix  */
+            cost += 25;
+            ix_off = hl_off;
+            ix_ok = 1;
+        }
+        if (off - ix_off >= -128 && off - ix_off <= 127) {
+            emit(0xdd); emit(op); emit(off - ix_off); /* op (ix+d) */
+            cost += op == 0x36 ? 9 : 12;
+            return;
+        }
+    }
+    emit_at(off);
+    emit(op);
+}
+
 /* "+" and "-" are implemented in terms of emit_add().
 
    We support changing the value of the cell by more than 1 at a time in
@@ -213,105 +1415,593 @@ void emit_output() {
 
    As a micro-optimisation, we revert to "inc (hl)" and "dec (hl)" when only
    changing the value by 1, because these execute in 11 clock cycles, compared
-   to the 21 cycles required for arbitrary addition.*/
-void emit_add(unsigned char n) {
+   to the 21 cycles required for arbitrary addition.
+
+   If the cell is already in a then we don't need to load it again. */
+void emit_add(unsigned char n, int off) {
+    if (n == 0)
+        return;
+    if (!costing) {
+        if (n == 1 || n == 0xff) fast_add++;
+        else slow_add++;
+    }
     if (n == 1) {
-        emit(0x34);          /* inc (hl)   */
+        emit_cell(0x34, off);          /* inc (hl)   */
+        clobber(off);
+        z_off = off;
     } else if (n == 0xff) {
-        emit(0x35);          /* dec (hl)   */
-    } else if (n != 0) {
-        emit(0x7e);          /* ld a, (hl) */
-        emit(0xc6); emit(n); /* add a, $n  */
-        emit(0x77);          /* ld (hl), a */
+        emit_cell(0x35, off);          /* dec (hl)   */
+        clobber(off);
+        z_off = off;
+    } else {
+        if (a_off != off)
+            emit_cell(0x7e, off);      /* ld a, (hl) */
+        keep_af = 1;
+        emit(0xc6); emit(n);           /* add a, $n  */
+        emit_cell(0x77, off);          /* ld (hl), a */
+        keep_af = 0;
+        a_off = z_off = off;
+    }
+}
+
+/* OP_SET is generated by the optimiser for loops like "[-]", which always
+   leave the cell at 0, and for any adjustment that follows them. Instead of
+   counting the cell down one step at a time, we can store the final value
+   directly, which takes only 10 cycles. */
+void emit_set(unsigned char n, int off) {
+    emit_cell(0x36, off); emit(n);     /* ld (hl), $n */
+    clobber(off);
+}
+
+/* Programs often clear or set a row of cells at once, like "[-]>[-]>[-]",
+   which the optimiser turns in to a run of OP_SETs to consecutive offsets.
+   Rather than "ld (hl), $n" for each one, we load the value in to a once and
+   store it with "ld (hl), a", which is 3 cycles and a byte shorter each time,
+   and leaves a holding the last cell.
+
+   With -Os, a run of FILL_LDIR cells or more is filled the same way as the
+   preamble clears the tape: store the value in the first cell, and have
+   "ldir" (or "lddr" for a run going left) copy it along. That's always 10
+   bytes, however long the run, but at 21 cycles per cell it's slower than
+   storing each one, so we don't do it otherwise, or in a counted loop,
+   which needs bc for itself. It leaves hl at the last
+   cell, so we just start counting the pointer from there.
+
+   Returns the index of the last OP_SET in the run. */
+#define FILL_LDIR 5
+
+int emit_fill(int i) {
+    int n, k, step, off;
+    unsigned char v;
+
+    v = ops[i].val;
+    off = ops[i].off;
+    step = i+1 < nops ? ops[i+1].off - off : 0;
+    for (n = 1; i+n < nops && ops[i+n].type == OP_SET && ops[i+n].val == v
+            && ops[i+n].off == off + n*step && (step == 1 || step == -1); n++);
+    if (n < (v ? 3 : 2)) {
+        emit_set(v, off);
+        return i;
     }
+
+    if (opt_size && !i8080 && !counting && n >= FILL_LDIR) {
+        emit_at(off);
+        emit(0x36); emit(v);          /* ld (hl), $v */
+        emit(0x54);                   /* ld d, h     */
+        emit(0x5d);                   /* ld e, l     */
+        emit(step > 0 ? 0x13 : 0x1b); /* inc/dec de  */
+        emit(0x01); emit((n-1)&0xff); emit((n-1)>>8); /* ld bc, $n-1 */
+        emit(0xed); emit(step > 0 ? 0xb0 : 0xb8);     /* ldir/lddr   */
+        hl_off = off + (n-1)*step;
+        for (k = 0; k < n; k++)
+            clobber(off + k*step);
+        return i+n-1;
+    }
+
+    if (v) {
+        emit(0x3e); emit(v);          /* ld a, $v    */
+        for (k = 0; k < n; k++)
+            clobber(off + k*step);
+    } else {
+        emit(0xaf);                   /* xor a       */
+        z_off = off + (n-1)*step;
+    }
+    keep_af = 1;
+    for (k = 0; k < n; k++)
+        emit_cell(0x77, off + k*step); /* ld (hl), a */
+    keep_af = 0;
+    a_off = off + (n-1)*step;
+    return i+n-1;
 }
 
-/* ">" and "<" are implemented in terms of emit_right().
+/* Add n times d to the cell at offset "off".
 
-   Again we support changing the memory pointer by more than 1 at a time.
+   Multiplying by 1 or -1 just needs an add or subtract of d. For anything
+   else, we compute a = d*n with the usual shift-and-add method, working from
+   the most significant bit of n down: double a for every bit, and add d for
+   each bit that is set. If n is "negative" (i.e. more than 128) it takes fewer
+   instructions to multiply by -n and subtract, so we do that instead, using
+   "cpl; inc a" to negate a. */
+void emit_mulcell(unsigned char n, int off) {
+    int neg, bit;
 
-   As a micro-optimisation, we revert to "inc hl" and "dec hl" when changing
-   the value by 3 or less because these execute in only 6 clock cycles,
-   compared to 21 cycles for arbitrary changes. */
-void emit_right(int n) {
-    if (n >= -3 && n < 0) {
-        while (n++) emit(0x2b);               /* dec hl     */
-    } else if (n <= 3 && n > 0) {
-        while (n--) emit(0x23);               /* inc hl     */
-    } else if (n != 0) {
-        emit(0x01); emit(n&0xff); emit(n>>8); /* ld bc, $n  */
-        emit(0x09);                           /* add hl, bc */
+    if (n == 1) {
+        keep_af = 1;
+        emit(0x7a);              /* ld a, d     */
+        emit_cell(0x86, off);    /* add a, (hl) */
+        emit_cell(0x77, off);    /* ld (hl), a  */
+        keep_af = 0;
+        return;
     }
+    if (n == 0xff) {
+        emit_cell(0x7e, off);    /* ld a, (hl)  */
+        emit(0x92);              /* sub d       */
+        emit_cell(0x77, off);    /* ld (hl), a  */
+        return;
+    }
+
+    neg = n > 128;
+    if (neg)
+        n = -n;
+    for (bit = 0x80; !(n & bit); bit >>= 1);
+    keep_af = 1;
+    emit(0x7a);                  /* ld a, d     */
+    for (bit >>= 1; bit; bit >>= 1) {
+        emit(0x87);              /* add a, a    */
+        if (n & bit)
+            emit(0x82);          /* add a, d    */
+    }
+    if (neg) {
+        emit(0x2f);              /* cpl         */
+        emit(0x3c);              /* inc a       */
+    }
+    emit_cell(0x86, off);        /* add a, (hl) */
+    emit_cell(0x77, off);        /* ld (hl), a  */
+    keep_af = 0;
 }
 
-/* "[": When entering a loop we push the current output location onto the stack
-   before emitting the loop start code.
+/* A run of OP_MUL ops (there is one per affected cell) comes from a single
+   multiply loop, and is always followed by an OP_SET to clear the loop's
+   control cell. We load the control cell in to d once, and then visit each
+   target cell in turn, adding the right multiple of d to it, and then clear
+   the control cell.
+
+   Strictly we don't need to test whether the control cell is 0 first, because
+   in that case we would just add 0 to everything, but lots of programs use
+   cells as flags that are usually 0, and the test is much cheaper than doing
+   all of the additions. So we skip straight past the whole thing if there's
+   nothing to do. The clear can be skipped too, because the cell is already 0,
+   unless the optimiser has folded a following "+" in to it.
+
+   Both routes have to arrive at the end with hl in the same place, so we put
+   hl back where it was before the test. If ix was changed in between, which
+   includes by the clear, then we can't know whether it has been set on the
+   route that skipped, so we forget about it. We don't know what's in a or the flags either.
+
+   With -Os we leave the test out, which saves 4 bytes.
+
+   Returns the index of the OP_SET that ends the run. */
+int emit_mul(int i) {
+    int skip, ctl_off, ok, xoff;
+
+    if (opt_size) {
+        if (a_off != ops[i].arg)
+            emit_cell(0x7e, ops[i].arg); /* ld a, (hl)  */
+        emit(0x57);                   /* ld d, a     */
+        a_off = z_off = NOWHERE;
+        keep_d = 1;
+        for (; ops[i].type == OP_MUL; i++)
+            emit_mulcell(ops[i].val, ops[i].off);
+        keep_d = 0;
+        emit_set(ops[i].val, ops[i].off);
+        return i;
+    }
+
+    if (z_off != ops[i].arg) {
+        if (a_off != ops[i].arg)
+            emit_cell(0x7e, ops[i].arg); /* ld a, (hl)  */
+        emit(0xb7);                   /* or a        */
+    } else if (a_off != ops[i].arg) {
+        /* The flags are right but we still need the value in a. */
+        emit_cell(0x7e, ops[i].arg);  /* ld a, (hl)  */
+    }
+    skip = prog_idx;
+    emit(0xca); emit(0); emit(0); /* jp z, $done */
+    emit(0x57);                   /* ld d, a     */
+    a_off = z_off = NOWHERE;
+
+    ctl_off = hl_off;
+    ok = ix_ok;
+    xoff = ix_off;
+    keep_d = 1;
+    for (; ops[i].type == OP_MUL; i++)
+        emit_mulcell(ops[i].val, ops[i].off);
+    keep_d = 0;
+    emit_at(ctl_off);
+    if (ops[i].val == 0)
+        emit_set(0, ops[i].off);
+    if (ix_ok != ok || ix_off != xoff)
+        ix_ok = 0;
+    if (!costing) {
+        patch(skip+1, label());
+    }
+    if (ops[i].val != 0)
+        emit_set(ops[i].val, ops[i].off);
+
+    return i;
+}
+
+/* OP_SCAN moves the pointer by n until it finds a cell containing 0.
+
+   For n = 1 or -1 the Z80 has an instruction that does exactly this: "cpir"
+   compares a with (hl), increments hl, and repeats until they're equal, in 21
+   cycles per cell ("cpdr" decrements instead). It also counts bc down and
+   stops at 0, but setting bc to 0 first gives us 65536 cells before that
+   happens, which is more than the whole of memory. It always moves hl on 1
+   past the matching cell, so we move it back afterwards.
+
+   For other steps, and on the 8080, we use a tight loop that does the pointer
+   movement with a single "add hl, de". We check the first cell before setting
+   up de, because quite often the pointer is already at a 0. With -Os the loop
+   is in a shared routine instead, which costs an extra 27 cycles for the
+   "call" and "ret" but saves 7 bytes at each scan.
+
+   Either way, we finish with the Z flag set, and a = 0 unless we skipped the
+   loop by testing flags left over from the previous op. */
+void emit_scan(int n) {
+    int top, done;
+
+    if ((n == 1 || n == -1) && !i8080) {
+        emit(0xaf);                           /* xor a          */
+        emit(0x47);                           /* ld b, a        */
+        emit(0x4f);                           /* ld c, a        */
+        emit(0xed); emit(n == 1 ? 0xb1 : 0xb9); /* cpir / cpdr  */
+        emit(n == 1 ? 0x2b : 0x23);           /* dec hl / inc hl */
+        a_off = z_off = 0;
+        return;
+    }
+
+    if (opt_size) {
+        emit(0x11); emit(n&0xff); emit(n>>8); /* ld de, $n      */
+        emit_call(&scan_refs);                /* call scan      */
+        a_off = z_off = 0;
+        return;
+    }
 
-   "or a" is used to set the condition flags based on the contents of the "a"
-   register.
+    if (z_off != 0) {
+        if (a_off != 0)
+            emit(0x7e);                       /* ld a, (hl)     */
+        emit(0xb7);                           /* or a           */
+        a_off = 0;
+    }
+    done = emit_jr(0x28);                     /* jr z, done     */
+    emit(0x11); emit(n&0xff); emit(n>>8);     /* ld de, $n      */
+    top = label();
+    emit(0x19);                               /* loop: add hl, de */
+    emit(0x7e);                               /* ld a, (hl)     */
+    emit(0xb7);                               /* or a           */
+    emit(0xc2); emit_addr(top);               /* jp nz, loop    */
+    land(done);
+    if (a_off != 0)                           /* done:          */
+        a_off = NOWHERE;
+    z_off = 0;
+}
 
-   We can't set the branch target address because we don't know it yet. This
-   will be filled in when the code for the matching "]" is generated. */
-void emit_loopstart() {
-    stack[sp++] = prog_idx;
+/* Loops are laid out with the test at the bottom:
+
+           guard: jp z, exit   ; skip the loop if the cell is 0
+           body:  ...
+                  jp nz, body  ; go round again if the cell isn't 0
+           exit:
+
+   so that each iteration only costs one conditional jump, instead of a
+   conditional jump at the top and an unconditional jump back to it at the
+   bottom.
+
+   Before each jump the flags need to reflect the current cell. If they
+   already do (say the loop body ended with "dec (hl)") then there's nothing
+   to do, and if a holds the cell then we just need "or a" to set the flags,
+   otherwise we load the cell in to a first. */
+void emit_test() {
+    if (z_off != 0) {
+        if (a_off != 0)
+            emit(0x7e);           /* ld a, (hl)    */
+        emit(0xb7);               /* or a          */
+        a_off = z_off = 0;
+    }
+}
+
+/* "[": Emit the guard, and push the address of the loop body onto the stack.
+
+   We can't set the guard's branch target address because we don't know it
+   yet. This will be filled in when the code for the matching "]" is
+   generated. If known_values() found that the cell can't be 0 here, we
+   don't need a guard at all.
+
+   The loop body can be reached from here or by jumping back from the end of
+   the loop, so we can't know what a holds at the start of the body, but we do
+   know that the Z flag reflects the (non-zero) current cell, as long as it
+   did when we arrived without a guard. For the benefit of emit_loopend() we
+   also push whether a held the cell when leaving the loop from the guard,
+   which is always true if there's no guard. */
+void emit_loopstart(int i) {
+    if (!ops[i].val) {
+        emit_test();
+        stack[sp++] = a_off == 0;
+        emit(0xca); emit(0); emit(0); /* jp z, $exit   */
+    } else {
+        stack[sp++] = 1;
+        if (z_off != 0)
+            z_off = NOWHERE;
+    }
+    stack[sp++] = label();
     if (sp >= STACKSZ) {
         fprintf(stderr, "error: stack overflow\n");
         exit(1);
     }
-    emit(0x7e);                   /* ld a, (hl)    */
-    emit(0xb7);                   /* or a          */
-    emit(0xca); emit(0); emit(0); /* jp z, $target */
+    a_off = NOWHERE;
+    if (profile)
+        emit_count();
 }
 
-/* "]": Pop the address of the matching "[" off the stack and generate code to
-   jump there.
+/* "]": Pop the address of the loop body off the stack and generate code to
+   jump back there if the current cell isn't 0.
 
-   Modify the loop start code to set the correct branch target address for
-   when the loop exits.
+   If there's a guard, modify it to set the correct branch target address for
+   when the loop is skipped.
 
    Notice that all of the branch targets have 1 added to their (little-endian)
-   high byte. This is because the code is loaded at 0x100 when executing. */
-void emit_loopend() {
-    int target;
-    if (sp <= 0) {
+   high byte. This is because the code is loaded at 0x100 when executing.
+
+   If known_values() found that the cell is always 0 here, the loop never
+   repeats, and we don't need the test.
+
+   The loop exits with the Z flag set either way (as long as it was tested
+   here), but a is only known to be 0 if it held the cell at both the guard
+   and here. */
+void emit_loopend(int i) {
+    int body, guard_a;
+    if (sp <= 1) {
         fprintf(stderr, "error: stack undeflow\n");
         exit(1);
     }
-    target = stack[--sp];
-    emit(0xc3); emit(target&0xff); emit(1+(target>>8)); /* jp $target */ 
-    prog[target+3] = prog_idx&0xff;
-    prog[target+4] = 1+(prog_idx>>8);
+    body = stack[--sp];
+    guard_a = stack[--sp];
+    if (!ops[i].val) {
+        emit_test();
+        if (opt_size && !i8080 && body - (prog_idx+2) >= -128) {
+            emit(0x20); emit(body - (prog_idx+1));      /* jr nz, body  */
+        } else {
+            emit(0xc2); emit(body&0xff); emit(1+(body>>8)); /* jp nz, $body */
+        }
+    }
+    if (!ops[ops[i].arg].val) {
+        patch(body-2, label());
+    } else if (ops[i].val) {
+        /* No guard and no test, so nothing joins here. */
+        return;
+    }
+    if (a_off != 0 || !guard_a)
+        a_off = NOWHERE;
+    if (z_off != 0)
+        z_off = NOWHERE;
+}
+
+/* Lots of loops that aren't multiply loops, because they have I/O or other
+   loops in them, still have the shape "[- ... ]": the body decrements the
+   control cell once per iteration, doesn't otherwise touch it, and ends up
+   back at it. Then the loop runs as many times as the cell's value when it
+   starts, and leaves it at 0. So we can load the count in to b, clear the
+   cell straight away, and end each iteration with "djnz body", which is 13
+   cycles instead of the "dec (hl)" and the test and "jp nz" that it
+   replaces:
+
+           guard: jp z, exit   ; skip the loop if the cell is 0
+                  push bc      ; only if this is inside another counted loop
+                  ld b, (hl)
+                  ld (hl), 0
+           body:  ...
+                  djnz body
+                  pop bc
+           exit:
+
+   For this the position of every op in the body relative to the control
+   cell has to be known, so there can't be any scans, and every loop inside
+   has to end up where it started. An op at any depth that uses the cell
+   rules it out, and so does a loop inside that tests it. So does partial
+   evaluation stopping inside the loop, because then we jump in to the
+   middle of the body without having loaded b.
+
+   counted_loop() returns the index of the op that decrements the cell, or
+   -1 if the loop at index i isn't a counted loop. */
+int counted_loop(int i) {
+    int k, m, end, pos, depth, dec, p;
+
+    end = ops[i].arg;
+    if (!opt_level || ops[end].val || (i < eval_pc && eval_pc <= end))
+        return -1;
+    pos = depth = 0;
+    dec = -1;
+    for (k = i+1; k < end; k++) {
+        switch (ops[k].type) {
+        case OP_MOVE:
+            pos += ops[k].arg;
+            break;
+        case OP_SCAN:
+            return -1;
+        case OP_LOOP:
+            if (pos == 0)
+                return -1;
+            depth++;
+            break;
+        case OP_END:
+            for (p = 0, m = ops[k].arg; m < k; m++)
+                if (ops[m].type == OP_MOVE)
+                    p += ops[m].arg;
+            if (p != 0)
+                return -1;
+            depth--;
+            break;
+        case OP_ADD:
+            if (ops[k].off != -pos)
+                break;
+            if (depth || dec >= 0 || ops[k].val != 0xff)
+                return -1;
+            dec = k;
+            break;
+        case OP_MUL:
+            if (ops[k].arg == -pos)
+                return -1;
+            /* fall through */
+        case OP_SET:
+        case OP_IN:
+            if (ops[k].off == -pos)
+                return -1;
+            break;
+        case OP_OUT:
+            if (!ops[k].val && ops[k].off == -pos)
+                return -1;
+            break;
+        }
+    }
+    return pos == 0 ? dec : -1;
+}
+
+/* "[" for a counted loop, where "dec" is the index of the op that
+   decrements the control cell. Its work is done by the "djnz", so
+   generate_op() skips it, which it knows to do from count_dec.
+
+   We push the guard (or 0 if there isn't one), whether bc was saved, the
+   count_dec of any counted loop outside this one, the body, and COUNTED, so
+   that the "]" can tell it apart from the other kind of loop. */
+#define COUNTED 0xffff
+
+void emit_countstart(int i, int dec) {
+    int guard;
+
+    guard = 0;
+    if (!ops[i].val) {
+        emit_test();
+        emit(0xca);               /* jp z, $exit   */
+        guard = prog_idx;
+        emit(0); emit(0);
+    }
+    stack[sp++] = guard;
+    stack[sp++] = counting > 0;
+    stack[sp++] = count_dec;
+    count_dec = dec;
+    if (counting++)
+        emit(0xc5);               /* push bc       */
+    emit(0x46);                   /* ld b, (hl)    */
+    emit(0x36); emit(0);          /* ld (hl), 0    */
+    stack[sp++] = label();
+    stack[sp++] = COUNTED;
+    if (sp >= STACKSZ) {
+        fprintf(stderr, "error: stack overflow\n");
+        exit(1);
+    }
+    a_off = z_off = NOWHERE;
+    if (profile)
+        emit_count();
+}
+
+/* "]" for a counted loop. The 8080 doesn't have "djnz", and it can only
+   reach 128 bytes back anyway, so otherwise it's "dec b; jp nz, body". */
+void emit_countend() {
+    int body, saved, guard;
+
+    sp--;
+    body = stack[--sp];
+    count_dec = (int)stack[--sp];
+    saved = stack[--sp];
+    guard = stack[--sp];
+    if (!i8080 && body - (prog_idx+2) >= -128) {
+        emit(0x10); emit(body - (prog_idx+1));          /* djnz body    */
+    } else {
+        emit(0x05);                                     /* dec b        */
+        emit(0xc2); emit(body&0xff); emit(1+(body>>8)); /* jp nz, $body */
+    }
+    if (saved)
+        emit(0xc1);               /* pop bc        */
+    counting--;
+    if (guard)
+        patch(guard, label());
+    a_off = z_off = NOWHERE;
 }
 
 /* TOKENISER */
 
-/* peek() returns the next byte from the source file, reading it using fgetc()
-   if necessary.
+/* Most bytes in a typical Brainfuck source are comments, so we want to skip
+   over them quickly. Rather than comparing each byte against all 8 Brainfuck
+   characters, we look it up in src_class[], which gives the class of each
+   byte: 0 for a comment, or one of these for a Brainfuck character. The "+"
+   and "-" characters share a class, as do ">" and "<", because the parser
+   treats runs of them together. */
+#define CL_ADD   1 /* "+" or "-" */
+#define CL_MOVE  2 /* ">" or "<" */
+#define CL_OTHER 4 /* ".", ",", "[" or "]" */
+
+void init_classes() {
+    src_class['+'] = src_class['-'] = CL_ADD;
+    src_class['>'] = src_class['<'] = CL_MOVE;
+    src_class['.'] = src_class[','] = CL_OTHER;
+    src_class['['] = src_class[']'] = CL_OTHER;
+}
+
+/* Count the lines in src_buf up to src_pos, for the source line of each op
+   (see add_op()). Only the parser's position is counted, because it's much
+   cheaper than looking for '\n' in skip_comments(). */
+void count_lines() {
+    for (; line_pos < src_pos; line_pos++)
+        if (src_buf[line_pos] == '\n')
+            src_line++;
+}
+
+/* fill() reads the next block of the source file into src_buf, returning 0
+   at the end of the file.
 
    This is the only place that actually touches the file, and is also what
    sets src_eof when EOF is encountered. */
-int peek() {
-    if (src_char == -1) {
-        src_char = fgetc(src_fp);
-        if (src_char == EOF) src_eof = 1;
+int fill() {
+    if (track_src)
+        count_lines();
+    line_pos = 0;
+    src_off += src_len;
+    src_pos = 0;
+    src_len = fread(src_buf, 1, SRC_BUFSZ, src_fp);
+    if (src_len <= 0) {
+        src_len = 0;
+        src_eof = 1;
     }
-    return src_char;
+    return src_len;
 }
 
-/* To throw away the next byte from the file we just set src_char = -1 so that
-   peek() gives us the next byte next time. */
+/* peek() returns the next byte from the source file, or EOF. */
+int peek() {
+    if (src_pos == src_len && !fill())
+        return EOF;
+    return src_buf[src_pos]&0xff;
+}
+
+/* To throw away the next byte from the file we just advance src_pos. */
 void discard() {
-    src_char = -1;
+    src_pos++;
 }
 
-/* Check whether the next byte from the file is any one of the bytes in the "s"
-   string. It is used to tell when the next byte is not a Brainfuck character
-   so that it can be skipped over. */
-int peek_oneof(char *s) {
-    for (; *s; s++)
-        if (peek() == *s)
-            return 1;
-    return 0;
+/* Check whether the next byte from the file is in any of the classes in the
+   "cl" bitmask. */
+int peek_class(int cl) {
+    return peek() != EOF && (src_class[peek()] & cl);
+}
+
+/* Skip over any non-Brainfuck characters. This is the tight loop that most
+   of the source goes through, so it works on the buffer directly and only
+   calls fill() when it runs off the end. */
+void skip_comments() {
+    do {
+        while (src_pos < src_len && !src_class[src_buf[src_pos]&0xff])
+            src_pos++;
+    } while (src_pos == src_len && fill());
 }
 
 /* Check if the next character is as specified, and if so consume it from the
@@ -319,82 +2009,1665 @@ int peek_oneof(char *s) {
 int consume(char c) {
     if (peek() == c) {
         discard();
+        ncmds++;
         return 1;
     }
     return 0;
 }
 
-/* MAIN */
+/* PARSER */
+
+/* Append an op to the program, growing the ops buffer as necessary in the
+   same way that emit() grows the prog buffer.
+
+   For -PROFILE and -SYM we also remember where in the source each op came
+   from: the offset and line of the token that parse() was at. */
+void add_op(int type, unsigned char val, int arg) {
+    if (nops >= ops_size) {
+        ops = grow(ops, &ops_size, sizeof(struct op));
+        if (track_src && (!(op_src = realloc(op_src, ops_size * sizeof(long)))
+                || !(op_line = realloc(op_line, ops_size * sizeof(int))))) {
+            fprintf(stderr, "error: out of memory\n");
+            exit(1);
+        }
+    }
+    if (track_src) {
+        op_src[nops] = tok_off;
+        op_line[nops] = src_line + 1;
+    }
+    ops[nops].type = type;
+    ops[nops].val = val;
+    ops[nops].off = 0;
+    ops[nops].arg = arg;
+    nops++;
+}
 
-int main(int argc, char **argv) {
-    int nright, i;
+/* Read the whole source file and turn it into ops.
+
+   We count the number of consecutive "+" or "-" operators, in any mixture,
+   and add a single OP_ADD for the total. Runs of ">" and "<" become a
+   single OP_MOVE in the same way. A run that cancels itself out ("+-" or
+   "<>") generates no op at all.
+
+   For loops, the index of each "[" op is pushed on to the stack, and when
+   we reach the matching "]" we pop it off again and link the two together.
+   This means mismatched brackets are caught here, before we've generated any
+   code. */
+void parse() {
+    int nright, target;
     unsigned char nadd;
-    char *output_name;
 
-    if (argc != 2) {
-        fprintf(stderr, "usage: BFC FOO.BF\n");
+    /* Skip over any non-Brainfuck characters at the start of the file. */
+    init_classes();
+    skip_comments();
+
+    while (!src_eof) {
+        tok_off = src_off + src_pos;
+        if (track_src)
+            count_lines();
+        if (peek_class(CL_ADD)) {
+            nadd = 0;
+            while (peek_class(CL_ADD))
+                if (consume('+')) nadd++;
+                else if (consume('-')) nadd--;
+            if (nadd)
+                add_op(OP_ADD, nadd, 0);
+        } else if (peek_class(CL_MOVE)) {
+            nright = 0;
+            while (peek_class(CL_MOVE))
+                if (consume('>')) nright++;
+                else if (consume('<')) nright--;
+            if (nright)
+                add_op(OP_MOVE, 0, nright);
+        } else if (consume('.')) {
+            add_op(OP_OUT, 0, 0);
+        } else if (consume(',')) {
+            add_op(OP_IN, 0, 0);
+        } else if (consume('[')) {
+            stack[sp++] = nops;
+            if (sp >= STACKSZ) {
+                fprintf(stderr, "error: loops nested too deeply\n");
+                exit(1);
+            }
+            add_op(OP_LOOP, 0, 0);
+        } else if (consume(']')) {
+            if (sp <= 0) {
+                fprintf(stderr, "error: unmatched ']'\n");
+                exit(1);
+            }
+            target = stack[--sp];
+            ops[target].arg = nops;
+            add_op(OP_END, 0, target);
+        }
+
+        /* Finally we skip over any non-Brainfuck characters that happen to be
+           present in the program source code. */
+        skip_comments();
+    }
+
+    if (sp != 0) {
+        fprintf(stderr, "error: unmatched '['\n");
         exit(1);
     }
+}
 
-    /* Let's generate the output filename.
+/* OPTIMISER */
 
-       In the worst case (argv[1] has no dot in it), we need to add 4 bytes to
-       its length (".COM") plus a trailing nul byte. */
-    output_name = malloc(strlen(argv[1]) + 5);
-    strcpy(output_name, argv[1]);
+/* The optimiser passes rewrite the ops in place, copying the ones that they
+   keep down over the ones they drop. An op that a pass makes up, such as the
+   OP_SET for a clear loop, gets the place in the source of the op it was
+   made from with src_from(). */
+void src_from(int j, int i) {
+    if (track_src) {
+        op_src[j] = op_src[i];
+        op_line[j] = op_line[i];
+    }
+}
 
-    /* Now find the final '.' in the filename (if any) and change the extension
-       to ".COM".
+void copy_op(int j, int i) {
+    ops[j] = ops[i];
+    src_from(j, i);
+}
 
-       On CP/M there can only be one '.' character, but it doesn't hurt to stay
-       portable. */
-    for (i = strlen(output_name)-1; i>0 && output_name[i]!='.'; i--);
-    if (i)
-        output_name[i] = '\0';
-    strcat(output_name, ".COM");
+void swap_op(int j, int i) {
+    struct op t;
+    long src;
+    int line;
 
-    /* Allocate the stack, load the source file, and emit the preamble code. */
-    stack = malloc(sizeof(int) * STACKSZ);
-    load(argv[1]);
-    emit_preamble();
+    t = ops[j]; ops[j] = ops[i]; ops[i] = t;
+    if (track_src) {
+        src = op_src[j]; op_src[j] = op_src[i]; op_src[i] = src;
+        line = op_line[j]; op_line[j] = op_line[i]; op_line[i] = line;
+    }
+}
 
-    /* Loop until we've reached EOF on the source code file. */
-    while (!src_eof) {
-        /* We count the number of consecutive "+" or "-" operators and
-           emit_add() accordingly.
-
-           emit_add() generates no code when nadd == 0. */
-        nadd = 0;
-        while (consume('+')) nadd++;
-        while (consume('-')) nadd--;
-        emit_add(nadd);
-
-        /* Similarly, we count the number of consecutive ">" or "<" operators
-           and emit_right() accordingly.
-
-           emit_right() also generates no code when nright == 0. */
-        nright = 0;
-        while (consume('>')) nright++;
-        while (consume('<')) nright--;
-        emit_right(nright);
-
-        /* Other operators are more straightforward. */
-        if (consume('.')) emit_output();
-        if (consume(',')) emit_input();
-        if (consume('[')) emit_loopstart();
-        if (consume(']')) emit_loopend();
+/* "[-]" is the usual idiom for setting a cell to 0, and it's very common. A
+   loop whose body is a single OP_ADD always terminates with the cell at 0 if
+   the amount added is odd, because repeatedly adding an odd number will hit
+   every value mod 256 before coming back round. So "[+]" and "[---]" are also
+   clear loops. (With an even amount the loop might never terminate, so we
+   leave it alone.) */
+int is_clear_loop(int i) {
+    return i+2 < nops && ops[i].type == OP_LOOP && ops[i+1].type == OP_ADD
+        && (ops[i+1].val & 1) && ops[i+2].type == OP_END;
+}
 
-        /* Finally we skip over any non-Brainfuck characters that happen to be
-           present in the program source code. */
-        while (!src_eof && !peek_oneof("+-><.,[]"))
-            discard();
+/* A "scan loop" like "[>]" or "[<<<<]" contains nothing but pointer movement,
+   so it just moves the pointer in steps until it finds a cell that is 0. */
+int is_scan_loop(int i) {
+    return i+2 < nops && ops[i].type == OP_LOOP && ops[i+1].type == OP_MOVE
+        && ops[i+2].type == OP_END;
+}
+
+/* A "multiply loop" like "[->+>+++<<]" adds a multiple of the current cell to
+   some other cells, and leaves the current cell at 0. We can recognise these
+   when the loop body contains only OP_ADD and OP_MOVE, the moves add up to 0
+   so that each iteration starts at the same cell, and the current cell itself
+   is changed by exactly 1 per iteration.
+
+   If the current cell is decremented then the loop runs once per unit of its
+   value, c, so everything else gets c times its per-iteration change. If the
+   current cell is incremented instead, the loop runs 256-c times, which mod
+   256 is the same as -c times, so we just negate the factors.
+
+   The per-iteration changes are collected in mul_off[] and mul_val[], with
+   offset 0 always in the first slot. We only handle up to MULSZ distinct
+   cells, which is plenty for real programs, and only offsets that fit in an
+   op. */
+#define MULSZ 16
+
+int mul_off[MULSZ];
+unsigned char mul_val[MULSZ];
+int mul_n;
+
+int is_mul_loop(int i) {
+    int k, pos, end;
+
+    if (ops[i].type != OP_LOOP)
+        return 0;
+    end = ops[i].arg;
+
+    mul_n = 1;
+    mul_off[0] = 0;
+    mul_val[0] = 0;
+    pos = 0;
+    for (i++; i < end; i++) {
+        if (ops[i].type == OP_MOVE) {
+            pos += ops[i].arg;
+            if (pos < -128 || pos > 127)
+                return 0;
+        } else if (ops[i].type == OP_ADD) {
+            for (k = 0; k < mul_n && mul_off[k] != pos; k++);
+            if (k == mul_n) {
+                if (mul_n == MULSZ)
+                    return 0;
+                mul_off[mul_n] = pos;
+                mul_val[mul_n] = 0;
+                mul_n++;
+            }
+            mul_val[k] += ops[i].val;
+        } else {
+            return 0;
+        }
+    }
+
+    return pos == 0 && (mul_val[0] == 1 || mul_val[0] == 0xff);
+}
+
+/* Having found a multiply loop with is_mul_loop(), write out an OP_MUL for
+   each affected cell, followed by an OP_SET to clear the current cell, at
+   index j, for the loop at index i. Returns the index after the last op
+   written. */
+int mul_loop(int j, int i) {
+    int k;
+
+    for (k = 1; k < mul_n; k++) {
+        if (!mul_val[k])
+            continue;
+        src_from(j, i);
+        ops[j].type = OP_MUL;
+        ops[j].val = mul_val[0] == 1 ? -mul_val[k] : mul_val[k];
+        ops[j].off = mul_off[k];
+        ops[j].arg = 0;
+        j++;
+    }
+    src_from(j, i);
+    ops[j].type = OP_SET;
+    ops[j].val = 0;
+    ops[j].off = 0;
+    return j+1;
+}
+
+/* The optimiser makes a single pass over the ops, rewriting patterns as it
+   goes. The output is written back in to the same array, which is safe
+   because no pattern is ever replaced with more ops than it had originally.
+
+   Because the ops move around, the loop links need to be reconstructed, which
+   we do with the stack in the same way as parse().
+
+   Alongside the pattern replacement, an OP_ADD that immediately follows an
+   OP_SET is folded into it ("[-]+++" just sets the cell to 3), and an
+   OP_ADD or OP_SET that is immediately followed by an OP_SET is discarded,
+   because its result would be overwritten anyway. */
+void optimise() {
+    int i, j, target;
+
+    for (i = j = 0; i < nops; i++) {
+        if (is_clear_loop(i)) {
+            if (j > 0 && (ops[j-1].type == OP_ADD || ops[j-1].type == OP_SET)
+                    && ops[j-1].off == 0)
+                j--;
+            src_from(j, i);
+            ops[j].type = OP_SET;
+            ops[j].val = 0;
+            ops[j].off = 0;
+            j++;
+            i += 2;
+            continue;
+        }
+
+        if (is_scan_loop(i)) {
+            src_from(j, i);
+            ops[j].type = OP_SCAN;
+            ops[j].val = 0;
+            ops[j].off = 0;
+            ops[j].arg = ops[i+1].arg;
+            j++;
+            i += 2;
+            continue;
+        }
+
+        if (is_mul_loop(i)) {
+            target = ops[i].arg;
+            j = mul_loop(j, i);
+            i = target;
+            continue;
+        }
+
+        if (ops[i].type == OP_ADD && j > 0 && ops[j-1].type == OP_SET
+                && ops[j-1].off == ops[i].off) {
+            ops[j-1].val += ops[i].val;
+            continue;
+        }
+
+        copy_op(j, i);
+        if (ops[j].type == OP_LOOP) {
+            stack[sp++] = j;
+        } else if (ops[j].type == OP_END) {
+            target = stack[--sp];
+            ops[target].arg = j;
+            ops[j].arg = target;
+        }
+        j++;
     }
 
-    /* Emit the postamble code, save the generated code to the output file,
-       and print a '\n' to terminate the "++++++++++" on the console. */
+    nops = j;
+}
+
+/* Once the patterns have been replaced, we get rid of as much of the pointer
+   movement as we can. Within each stretch of code between loop boundaries,
+   we keep track of how far the pointer would have moved, and instead of
+   generating an OP_MOVE we add that distance to the offset of each op. A
+   single OP_MOVE at the end of the stretch then puts the pointer where it
+   should be before the loop test. So ">+>+<<-" becomes "add 1 to cell 1, add
+   1 to cell 2, subtract 1 from cell 0" with no movement at all.
+
+   An OP_SCAN also needs the pointer to be in the right place, and afterwards
+   we don't know how far it has moved, so that ends a stretch as well.
+
+   The pointer doesn't matter after the last op of the program, so any
+   movement left over at the end is just dropped.
+
+   If an offset would get too large to fit in an op, we emit an OP_MOVE for the
+   distance so far and start counting from 0 again.
+
+   While we're at it, an OP_ADD or OP_SET can be merged with the previous op
+   earlier in the same stretch that touches the same cell, as long as that op
+   was an OP_ADD or OP_SET too, because nothing in between can see the
+   difference. So ">+<+>+<" has only 2 ops. */
+int touches(int k, int off) {
+    switch (ops[k].type) {
+    case OP_OUT:
+        return !ops[k].val && ops[k].off == off;
+    case OP_ADD:
+    case OP_SET:
+    case OP_IN:
+        return ops[k].off == off;
+    case OP_MUL:
+        return ops[k].off == off || ops[k].arg == off;
+    }
+    return 1;
+}
+
+/* Write an OP_MOVE at index j if the pointer needs to move before the op at
+   index i, and return the index after it. */
+int flush_move(int j, int pos, int i) {
+    if (pos) {
+        src_from(j, i);
+        ops[j].type = OP_MOVE;
+        ops[j].val = 0;
+        ops[j].off = 0;
+        ops[j].arg = pos;
+        j++;
+    }
+    return j;
+}
+
+void fold_offsets() {
+    int i, j, k, pos, start, off, src, type, target;
+
+    pos = start = 0;
+    for (i = j = 0; i < nops; i++) {
+        type = ops[i].type;
+
+        if (type == OP_MOVE) {
+            pos += ops[i].arg;
+            continue;
+        }
+
+        if (type == OP_LOOP || type == OP_END || type == OP_SCAN) {
+            j = flush_move(j, pos, i);
+            pos = 0;
+            copy_op(j, i);
+            if (type == OP_LOOP) {
+                stack[sp++] = j;
+            } else if (type == OP_END) {
+                target = stack[--sp];
+                ops[target].arg = j;
+                ops[j].arg = target;
+            }
+            start = ++j;
+            continue;
+        }
+
+        off = pos + ops[i].off;
+        src = pos + ops[i].arg;
+        if (off < -128 || off > 127 || (type == OP_MUL && (src < -128 || src > 127))) {
+            j = flush_move(j, pos, i);
+            pos = 0;
+            start = j;
+            off = ops[i].off;
+            src = ops[i].arg;
+        }
+
+        copy_op(j, i);
+        ops[j].off = off;
+        if (type == OP_MUL)
+            ops[j].arg = src;
+
+        if (type == OP_ADD || type == OP_SET) {
+            for (k = j-1; k >= start && !touches(k, off); k--);
+            if (k >= start && (ops[k].type == OP_ADD || ops[k].type == OP_SET)) {
+                if (type == OP_ADD) {
+                    ops[k].val += ops[j].val;
+                } else {
+                    ops[k].type = OP_SET;
+                    ops[k].val = ops[j].val;
+                }
+                continue;
+            }
+        }
+        j++;
+    }
+
+    nops = j;
+}
+
+/* Since the tape starts out all 0, we often know what's in a cell without
+   running the program. We know the current cell is 0 straight after a loop
+   or a scan, and it stays known until something we can't predict happens to
+   it. Knowing the values lets us:
+
+    - delete loops that can never run, like a comment loop at the start of
+      the program, or a loop straight after another loop's "]"
+    - mark loops that are sure to run at least once, so they don't need a
+      guard, and loops that are sure to only run once, so they don't need a
+      test at the end
+    - delete a scan that is already at a 0
+    - turn an OP_ADD to a known cell into an OP_SET, which is cheaper
+    - delete an OP_SET that doesn't change the cell
+    - turn an OP_MUL into an OP_ADD when we know the control cell, or delete
+      it when the control cell is 0
+    - work out what a loop does altogether when we know how many times it
+      will run, and replace it with the result (see fold_loop())
+    - mark an OP_OUT whose byte we know, so that runs of constant output
+      can be written all at once (see emit_print())
+
+   known[] holds the value of the cells either side of the pointer, or
+   UNKNOWN, and known_rest holds the value of every cell outside that range,
+   which is only ever known before the first loop or scan. The body of a loop
+   can be reached from its end, so we forget everything at both ends of a
+   loop. */
+#define KNOWNSZ 128
+#define UNKNOWN -1
+
+int known[2*KNOWNSZ];
+int known_rest;
+
+int get_known(int off) {
+    if (off < -KNOWNSZ || off >= KNOWNSZ)
+        return known_rest;
+    return known[off+KNOWNSZ];
+}
+
+void set_known(int off, int v) {
+    if (off < -KNOWNSZ || off >= KNOWNSZ)
+        known_rest = UNKNOWN;
+    else
+        known[off+KNOWNSZ] = v;
+}
+
+void forget_known() {
+    int k;
+    for (k = 0; k < 2*KNOWNSZ; k++)
+        known[k] = UNKNOWN;
+    known_rest = UNKNOWN;
+}
+
+/* The pointer moved by n, so everything we know moves by -n. Cells that
+   slide out of known[] join the rest, so if any of them isn't known_rest,
+   we no longer know what the rest holds. */
+void move_known(int n) {
+    int k;
+    for (k = 0; k < 2*KNOWNSZ; k++)
+        if ((n > 0 ? k < n : k >= 2*KNOWNSZ+n) && known[k] != known_rest)
+            known_rest = UNKNOWN;
+    if (n > 0) {
+        for (k = 0; k < 2*KNOWNSZ; k++)
+            known[k] = k+n < 2*KNOWNSZ ? known[k+n] : known_rest;
+    } else if (n < 0) {
+        for (k = 2*KNOWNSZ-1; k >= 0; k--)
+            known[k] = k+n >= 0 ? known[k+n] : known_rest;
+    }
+}
+
+/* A loop whose body is only OP_ADD, OP_SET and OP_MUL does the same thing
+   to the same cells every time round, because it doesn't move the pointer.
+   If we know the value of the current cell, then we can run the loop here
+   and replace it with one op for each cell that it touches: an OP_SET if we
+   know what the cell ends up as, or else an OP_ADD of the total that was
+   added to it. An OP_MUL is only a multiply loop nested inside this one, so
+   this gets rid of setups like "++++++++[>++++[>++>+++<<-]<-]" altogether.
+
+   We go round at most FOLDMAX times, in case the loop never ends, and give
+   up if the body touches more than FOLDSZ cells, or has an OP_MUL whose
+   control cell we don't know. Otherwise the ops are written at index j,
+   and we return the index after them. There can't be more of them than
+   there were ops in the loop, so they fit. As in fold_offsets(), an op can
+   be merged in to an earlier OP_ADD or OP_SET of the same cell, which is
+   usually the one that set up the loop's counter. */
+#define FOLDSZ  16
+#define FOLDMAX 256
+
+int fold_off[FOLDSZ]; /* Offsets of the cells the loop touches        */
+int fold_val[FOLDSZ]; /* Their values, or how much was added to them  */
+char fold_set[FOLDSZ]; /* 1 if fold_val[] is the value                */
+int nfold;            /* The number of cells                          */
+
+/* Find the cell at offset "off" in the table, adding it if necessary, and
+   return its index, or -1 if the table is full. */
+int fold_cell(int off) {
+    int k;
+    for (k = 0; k < nfold && fold_off[k] != off; k++);
+    if (k < nfold)
+        return k;
+    if (nfold == FOLDSZ)
+        return -1;
+    fold_off[k] = off;
+    fold_val[k] = get_known(off);
+    fold_set[k] = fold_val[k] != UNKNOWN;
+    if (!fold_set[k])
+        fold_val[k] = 0;
+    nfold++;
+    return k;
+}
+
+int fold_loop(int i, int j) {
+    int end, n, k, m, c, src;
+
+    end = ops[i].arg;
+    nfold = 0;
+    fold_cell(0);
+    for (k = i+1; k < end; k++) {
+        if (ops[k].type != OP_ADD && ops[k].type != OP_SET
+                && ops[k].type != OP_MUL)
+            return -1;
+        if (fold_cell(ops[k].off) < 0)
+            return -1;
+        if (ops[k].type == OP_MUL && fold_cell(ops[k].arg) < 0)
+            return -1;
+    }
+
+    for (n = 0; fold_val[0]; n++) {
+        if (n == FOLDMAX)
+            return -1;
+        for (k = i+1; k < end; k++) {
+            c = fold_cell(ops[k].off);
+            switch (ops[k].type) {
+            case OP_ADD:
+                fold_val[c] = (fold_val[c] + ops[k].val) & 0xff;
+                break;
+            case OP_SET:
+                fold_val[c] = ops[k].val;
+                fold_set[c] = 1;
+                break;
+            case OP_MUL:
+                src = fold_cell(ops[k].arg);
+                if (!fold_set[src])
+                    return -1;
+                fold_val[c] = (fold_val[c] + ops[k].val*fold_val[src]) & 0xff;
+                break;
+            }
+        }
+    }
+
+    for (k = 0; k < nfold; k++) {
+        if (fold_set[k] ? get_known(fold_off[k]) == fold_val[k] : !fold_val[k])
+            continue;
+        if (fold_set[k])
+            set_known(fold_off[k], fold_val[k]);
+        for (m = j-1; m >= 0 && !touches(m, fold_off[k]); m--);
+        if (m >= 0 && (ops[m].type == OP_ADD || ops[m].type == OP_SET)) {
+            if (fold_set[k]) {
+                ops[m].type = OP_SET;
+                ops[m].val = fold_val[k];
+            } else {
+                ops[m].val += fold_val[k];
+            }
+            continue;
+        }
+        src_from(j, i);
+        ops[j].type = fold_set[k] ? OP_SET : OP_ADD;
+        ops[j].val = fold_val[k];
+        ops[j].off = fold_off[k];
+        ops[j].arg = 0;
+        j++;
+    }
+    return j;
+}
+
+void known_values() {
+    int i, j, k, v, target;
+
+    for (k = 0; k < 2*KNOWNSZ; k++)
+        known[k] = 0;
+    known_rest = 0;
+
+    for (i = j = 0; i < nops; i++) {
+        switch (ops[i].type) {
+        case OP_MUL:
+            v = get_known(ops[i].arg);
+            if (v == 0)
+                continue;
+            if (v != UNKNOWN) {
+                ops[i].type = OP_ADD;
+                ops[i].val *= v;
+                ops[i].arg = 0;
+            } else {
+                set_known(ops[i].off, UNKNOWN);
+                break;
+            }
+            /* fall through */
+        case OP_ADD:
+            v = get_known(ops[i].off);
+            if (v != UNKNOWN) {
+                ops[i].type = OP_SET;
+                ops[i].val += v;
+            }
+            set_known(ops[i].off, v == UNKNOWN ? UNKNOWN : ops[i].val);
+            break;
+        case OP_SET:
+            if (get_known(ops[i].off) == ops[i].val)
+                continue;
+            set_known(ops[i].off, ops[i].val);
+            break;
+        case OP_IN:
+            set_known(ops[i].off, UNKNOWN);
+            break;
+        case OP_OUT:
+            v = get_known(ops[i].off);
+            if (v == UNKNOWN || v == '$')
+                break;
+            ops[i].val = 1;
+            ops[i].arg = v;
+            ops[i].off = 0;
+            for (k = j-1; k >= 0 && (ops[k].type == OP_ADD
+                    || ops[k].type == OP_SET || ops[k].type == OP_MUL
+                    || ops[k].type == OP_MOVE); k--);
+            if (k < 0 || k == j-1 || ops[k].type != OP_OUT || !ops[k].val)
+                break;
+            copy_op(j, i);
+            for (v = j; v > k+1; v--)
+                swap_op(v, v-1);
+            j++;
+            continue;
+        case OP_MOVE:
+            move_known(ops[i].arg);
+            break;
+        case OP_SCAN:
+            if (get_known(0) == 0)
+                continue;
+            forget_known();
+            set_known(0, 0);
+            break;
+        case OP_LOOP:
+            v = get_known(0);
+            if (v == 0) {
+                i = ops[i].arg;
+                continue;
+            }
+            target = ops[i].arg;
+            if (v != UNKNOWN && (k = fold_loop(i, j)) >= 0) {
+                i = target;
+                j = k;
+                continue;
+            }
+            ops[i].val = v != UNKNOWN;
+            forget_known();
+            break;
+        case OP_END:
+            /* If the loop had no guard and doesn't repeat either, it's just
+               straight-line code and we can carry on knowing everything. */
+            ops[i].val = get_known(0) == 0;
+            if (!ops[i].val || !ops[stack[sp-1]].val) {
+                forget_known();
+                set_known(0, 0);
+            }
+            break;
+        }
+
+        copy_op(j, i);
+        if (ops[j].type == OP_LOOP) {
+            stack[sp++] = j;
+        } else if (ops[j].type == OP_END) {
+            target = stack[--sp];
+            ops[target].arg = j;
+            ops[j].arg = target;
+        }
+        j++;
+    }
+
+    nops = j;
+}
+
+/* PARTIAL EVALUATION */
+
+/* The tape starts out all 0, so until the program reads some input, what it
+   does is entirely determined by the source code. That means we can run
+   that part of it at compile time, and the generated program only needs to
+   write out the output it would have produced, set up the tape the way it
+   would have left it, and carry on from there. Lots of programs never read
+   any input at all, and can be run to completion.
+
+   We can't stop just anywhere, though, because the generated code for a
+   stretch between loop boundaries assumes it was entered at the top with hl
+   pointing at the current cell (see generate_stretch()). So we only stop at
+   the start of a stretch, which is a "safe point". Between two safe points
+   there is a fixed list of ops, so we only count steps at safe points, which
+   means a step is roughly one loop iteration. Moving a cell at a time in a
+   scan counts as a step too, as there's no limit to how long that can take.
+
+   Other things can stop us in the middle of a stretch: reaching an input op,
+   moving off either end of our tape, or filling up our output buffer. Then
+   we need to go back to the previous safe point. Rather than saving a copy
+   of the whole state at each one, we just run the program again from the
+   start and stop at the safe point before, which is wasteful but simple.
+
+   interpret() runs the program until safe point number "last" (counting from
+   0 at the start), or until it gets stuck. It returns the number of the last
+   safe point it reached, and sets eval_stuck if it didn't stop there. */
+int eval_stuck;
+
+/* Check that the cell at p is on the tape. */
+int on_tape(long p) {
+    return p >= 0 && p < EVAL_TAPESZ && (!tape_size || p < tape_size);
+}
+
+long interpret(long last) {
+    long steps, safe;
+    int pc, p;
+    struct op *op;
+
+    memset(eval_tape, 0, EVAL_TAPESZ);
+    eval_nout = 0;
+    eval_stuck = 0;
+    steps = 0;
+    safe = -1;
+    pc = p = 0;
+
+    for (;;) {
+        if (pc == 0 || pc == nops || ops[pc-1].type == OP_LOOP || ops[pc-1].type == OP_END) {
+            eval_pc = pc;
+            eval_ptr = p;
+            if (++safe == last || pc == nops || steps++ >= eval_steps)
+                return safe;
+        }
+        op = &ops[pc];
+
+        /* A multiply only touches its target if the control cell isn't 0,
+           and programs do rely on that when the target is off the tape. */
+        if (op->type == OP_MUL) {
+            if (!on_tape((long)p + op->arg))
+                break;
+            if (!eval_tape[p+op->arg]) {
+                pc++;
+                continue;
+            }
+        }
+        if (!on_tape((long)p + op->off)
+                || op->type == OP_IN
+                || (op->type == OP_OUT && eval_nout == EVAL_OUTSZ))
+            break;
+
+        switch (op->type) {
+        case OP_ADD:
+            eval_tape[p+op->off] += op->val;
+            break;
+        case OP_SET:
+            eval_tape[p+op->off] = op->val;
+            break;
+        case OP_MUL:
+            eval_tape[p+op->off] += op->val * eval_tape[p+op->arg];
+            break;
+        case OP_MOVE:
+            p += op->arg;
+            break;
+        case OP_OUT:
+            if (eval_nout >= eval_outsz)
+                eval_out = grow(eval_out, &eval_outsz, 1);
+            eval_out[eval_nout++] = op->val ? op->arg : eval_tape[p+op->off];
+            break;
+        case OP_LOOP:
+            if (!eval_tape[p])
+                pc = op->arg;
+            break;
+        case OP_END:
+            if (eval_tape[p])
+                pc = op->arg;
+            break;
+        case OP_SCAN:
+            while (eval_tape[p] && steps < eval_steps) {
+                p += op->arg;
+                steps++;
+                if (!on_tape(p))
+                    break;
+            }
+            if (!on_tape(p) || eval_tape[p]) {
+                eval_stuck = 1;
+                return safe;
+            }
+            break;
+        }
+        pc++;
+    }
+
+    eval_stuck = 1;
+    return safe;
+}
+
+/* Run as much of the program as we can at compile time, leaving the tape in
+   eval_tape, the pointer in eval_ptr, and the op to resume from in eval_pc. */
+void evaluate() {
+    long safe;
+
+    eval_tape = malloc(EVAL_TAPESZ);
+    if (!eval_tape) {
+        fprintf(stderr, "error: out of memory\n");
+        exit(1);
+    }
+    safe = interpret(-1L);
+    if (eval_stuck)
+        interpret(safe);
+
+    /* The tape only needs to be kept up to its last non-zero cell, because
+       the preamble clears the rest. */
+    for (eval_len = EVAL_TAPESZ; eval_len > 0 && !eval_tape[eval_len-1]; eval_len--);
+}
+
+/* STATISTICS */
+
+/* -STATS prints a report at the end about what the optimiser and the code
+   generator did, so that you can tell whether a change to either of them
+   helped, without having to run anything.
+
+   For the time, we add up how many cycles each instruction emitted for the
+   ops would take to run once, which says nothing about how many times it
+   really runs, but does go down when the code gets better. We get that by
+   decoding the instructions, so insn_cycles() only needs to know about the
+   ones that the code generator uses. It returns the cycles for the
+   instruction at index "at", and its length in "len", counting conditional
+   jumps as taken.
+
+   With -8080 the code only has 8080 instructions, and most of them take the
+   same time as on the Z80, but a few of the commonest ones don't, so
+   i8080_cycles() has those. */
+int i8080_cycles(int op) {
+    if (op == 0x34 || op == 0x35 || (op&0xcf) == 0x09)
+        return 10;                              /* inr/dcr m, dad  */
+    if ((op&0xc7) == 0x03 || (op&0xc6) == 0x04) /* inx/dcx, inr/dcr */
+        return 5;
+    if (op >= 0x40 && op < 0x80 && (op&7) != 6 && (op&0xf8) != 0x70)
+        return 5;                               /* mov r, r        */
+    return 0;
+}
+
+int insn_cycles(int at, int *len) {
+    int op, c;
+
+    op = get_byte(at);
+    *len = 1;
+    if (i8080 && (c = i8080_cycles(op)))
+        return c;
+    if (op == 0xdd) {
+        op = get_byte(at+1);
+        *len = 2;
+        if (op == 0xe1) return 14;              /* pop ix          */
+        if (op == 0xe5) return 15;              /* push ix         */
+        *len = op == 0x36 ? 4 : 3;
+        return op == 0x34 || op == 0x35 ? 23 : 19; /* op (ix+d)    */
+    }
+    if (op == 0xed) {
+        *len = 2;
+        return get_byte(at+1) == 0x52 ? 15 : 21; /* sbc, or ldir etc. */
+    }
+    switch (op) {
+    case 0x01: case 0x11: case 0x21:            /* ld rr, $nn      */
+    case 0xc2: case 0xc3: case 0xca:            /* jp              */
+        *len = 3; return 10;
+    case 0x22: case 0x2a:                       /* ld (nn), hl etc. */
+        *len = 3; return 16;
+    case 0x32: case 0x3a:                       /* ld ($nn), a etc. */
+        *len = 3; return 13;
+    case 0xcd:                                  /* call            */
+        *len = 3; return 17;
+    case 0x10:                                  /* djnz            */
+        *len = 2; return 13;
+    case 0x18: case 0x20: case 0x28:            /* jr              */
+        *len = 2; return 12;
+    case 0x06: case 0x0e: case 0x16: case 0x1e: case 0x3e: /* ld r, $n */
+    case 0xc6: case 0xce: case 0xe6: case 0xfe: /* alu a, $n       */
+        *len = 2; return 7;
+    case 0x36:                                  /* ld (hl), $n     */
+        *len = 2; return 10;
+    case 0x34: case 0x35:                       /* inc/dec (hl)    */
+    case 0x09: case 0x19:                       /* add hl, rr      */
+    case 0xc5: case 0xd5: case 0xe5: case 0xf5: /* push            */
+        return 11;
+    case 0x13: case 0x23: case 0x0b: case 0x1b: case 0x2b: /* inc/dec rr */
+        return 6;
+    case 0xc1: case 0xd1: case 0xe1: case 0xf1: /* pop             */
+    case 0xc9:                                  /* ret             */
+        return 10;
+    }
+    if ((op >= 0x40 && op < 0xc0 && (op&7) == 6) || (op&0xf8) == 0x70)
+        return 7;                               /* anything with (hl) */
+    return 4;
+}
+
+int op_group(int type) {
+    if (type == OP_LOOP || type == OP_END || type == OP_SCAN)
+        return 1;
+    if (type == OP_OUT || type == OP_IN)
+        return 2;
+    return 0;
+}
+
+/* Count up the ops of each type in the program. */
+void count_ops(int *counts) {
+    int i;
+    for (i = 0; i < NOPTYPES; i++)
+        counts[i] = 0;
+    for (i = 0; i < nops; i++)
+        counts[ops[i].type]++;
+}
+
+/* Add the code from index "start" up to "end" to the totals for the group
+   of ops of this type. */
+void count_code(int type, int start, int end) {
+    int g, len;
+    g = op_group(type);
+    group_bytes[g] += end - start;
+    if (elf)
+        return;
+    for (; start < end; start += len)
+        group_cycles[g] += insn_cycles(start, &len);
+}
+
+char *op_names[NOPTYPES] = {
+    "add", "move", "out", "in", "loop", "end", "set", "mul", "scan"
+};
+
+void print_stats() {
+    static char *groups[NGROUPS] = { "arithmetic", "loops", "I/O" };
+    int final[NOPTYPES];
+    int i, np;
+    long other;
+
+    count_ops(final);
+    for (i = np = 0; i < NOPTYPES; i++)
+        np += parsed[i];
+    printf("%ld commands, parsed in to %d ops, optimised to %d ops\n",
+        ncmds, np, nops);
+    printf("  op     parsed  optimised\n");
+    for (i = 0; i < NOPTYPES; i++)
+        printf("  %-6s %6d %10d\n", op_names[i], parsed[i], final[i]);
+    if (!elf) {
+        printf("emit_add(): %d inc/dec, %d add\n", fast_add, slow_add);
+        printf("emit_right(): %d inc/dec, %d add\n", fast_right, slow_right);
+    }
+
+    other = prog_idx;
+    printf("  code       bytes");
+    if (!elf)
+        printf("     cycles");
+    printf("\n");
+    for (i = 0; i < NGROUPS; i++) {
+        printf("  %-10s %5ld", groups[i], group_bytes[i]);
+        if (!elf)
+            printf(" %10ld", group_cycles[i]);
+        printf("\n");
+        other -= group_bytes[i];
+    }
+    printf("  %-10s %5ld (including runtime, data and padding)\n", "other", other);
+}
+
+/* LISTING */
+
+/* With -SYM, the code generator writes a line to FOO.LST for each op as it
+   goes, giving the address of its code, where the op came from in the
+   source, and what it does, like this:
+
+     0152    412     6  loop  L412
+     0155    413     6  add   [0] 255
+     0156    414     6  mul   [9] 1*[0]
+     0167    445     6  move  9
+     016B    445     6  end   L412
+
+   An op that generate_op() handles along with the ones after it, like the
+   OP_MULs of a multiply loop or a run of constant output, only gets a line
+   for the first one, because the rest don't have code of their own.
+
+   Each loop is labelled with the source offset of its "[", which is how
+   -PROFILE names them too. FOO.SYM has the address of the "[" and "]" of
+   each loop, in the format that ZSID reads along with
+   the program, so that its listing and breakpoints can use the labels:
+
+     0152 L412
+     016B E412 */
+void open_listing(char *sym_name, char *lst_name) {
+    if (!(sym_fp = fopen(sym_name, "w")) || !(lst_fp = fopen(lst_name, "w"))) {
+        fprintf(stderr, "error: can't write %s\n", sym_fp ? lst_name : sym_name);
+        exit(1);
+    }
+    fprintf(lst_fp, "addr  offset  line  op\n");
+}
+
+/* Write the line for the op at index i, whose code starts at address "at". */
+void list_op(int i, long at) {
+    struct op *op;
+    op = &ops[i];
+
+    fprintf(lst_fp, "%04lX %6ld %5d  %-5s", at, op_src[i], op_line[i],
+        op_names[op->type]);
+    switch (op->type) {
+    case OP_ADD:
+    case OP_SET:
+        fprintf(lst_fp, " [%d] %d", op->off, op->val);
+        break;
+    case OP_MUL:
+        fprintf(lst_fp, " [%d] %d*[%d]", op->off, op->val, op->arg);
+        break;
+    case OP_MOVE:
+    case OP_SCAN:
+        fprintf(lst_fp, " %d", op->arg);
+        break;
+    case OP_OUT:
+        if (op->val)
+            fprintf(lst_fp, " #%d", op->arg);
+        else
+            fprintf(lst_fp, " [%d]", op->off);
+        break;
+    case OP_IN:
+        fprintf(lst_fp, " [%d]", op->off);
+        break;
+    case OP_LOOP:
+        fprintf(lst_fp, " L%ld", op_src[i]);
+        fprintf(sym_fp, "%04lX L%ld\n", at, op_src[i]);
+        break;
+    case OP_END:
+        fprintf(lst_fp, " L%ld", op_src[op->arg]);
+        fprintf(sym_fp, "%04lX E%ld\n", at, op_src[op->arg]);
+        break;
+    }
+    fprintf(lst_fp, "\n");
+}
+
+void close_listing() {
+    fclose(sym_fp);
+    fclose(lst_fp);
+}
+
+/* GENERATION */
+
+/* Generate the code for the op at index i, and return the index of the last
+   op that was used, which is only different for multiply loops. */
+int generate_op(int i) {
+    int dec;
+
+    switch (ops[i].type) {
+    case OP_ADD:
+        if (i != count_dec)
+            emit_add(ops[i].val, ops[i].off);
+        break;
+    case OP_SET:
+        i = emit_fill(i);
+        break;
+    case OP_MUL:
+        i = emit_mul(i);
+        break;
+    case OP_MOVE:
+        /* hl moves to the new pointer position. ix, a and the flags stay
+           where they are, so their offsets from the new pointer position
+           change. */
+        emit_right(ops[i].arg - hl_off);
+        hl_off = 0;
+        ix_off -= ops[i].arg;
+        if (a_off != NOWHERE) a_off -= ops[i].arg;
+        if (z_off != NOWHERE) z_off -= ops[i].arg;
+        break;
+    case OP_SCAN:
+        emit_at(0);
+        emit_scan(ops[i].arg);
+        ix_ok = 0;
+        break;
+    case OP_OUT:
+        /* The console I/O clobbers bc, which a counted loop needs. */
+        if (counting)
+            emit(0xc5);           /* push bc */
+        if (ops[i].val) {
+            i = emit_print(i);
+        } else {
+            emit_at(ops[i].off);
+            emit_output();
+        }
+        if (counting)
+            emit(0xc1);           /* pop bc  */
+        ix_ok = 0;
+        break;
+    case OP_IN:
+        if (counting)
+            emit(0xc5);           /* push bc */
+        emit_at(ops[i].off);
+        emit_input();
+        if (counting)
+            emit(0xc1);           /* pop bc  */
+        ix_ok = 0;
+        break;
+    case OP_LOOP:
+        emit_at(0);
+        if ((dec = counted_loop(i)) >= 0)
+            emit_countstart(i, dec);
+        else
+            emit_loopstart(i);
+        ix_ok = 0;
+        break;
+    case OP_END:
+        emit_at(0);
+        if (stack[sp-1] == COUNTED)
+            emit_countend();
+        else
+            emit_loopend(i);
+        ix_ok = 0;
+        break;
+    }
+    return i;
+}
+
+/* Generate the ops from index i up to the next loop boundary, with the
+   current setting of use_ix, and return the cost: the number of cycles, or
+   with -Os the number of bytes. */
+long generate_stretch(int i) {
+    hl_off = 0;
+    ix_ok = 0;
+    cost = cost_bytes = 0;
+    for (; i < nops && ops[i].type != OP_LOOP && ops[i].type != OP_END; i++)
+        i = generate_op(i);
+    return opt_size ? cost_bytes : cost;
+}
+
+/* Decide whether to use ix for the stretch starting at index i. The 8080
+   doesn't have ix, so there's no decision to make, and with -O0 we don't
+   bother. */
+void plan_stretch(int i) {
+    long cost_hl;
+    int a, z;
+
+    use_ix = 0;
+    if (i8080 || !opt_level)
+        return;
+    a = a_off;
+    z = z_off;
+    costing = 1;
+    use_ix = 0;
+    cost_hl = generate_stretch(i);
+    a_off = a;
+    z_off = z;
+    use_ix = 1;
+    use_ix = generate_stretch(i) < cost_hl;
+    costing = 0;
+
+    hl_off = 0;
+    ix_ok = 0;
+    a_off = a;
+    z_off = z;
+}
+
+/* Walk through the ops and generate code for each one in turn. The loop
+   branch targets are resolved by emit_loopstart() and emit_loopend() using
+   the stack, which is empty again now that the optimiser has finished with
+   it. */
+void generate() {
+    int i, live, resume, first, last, last_start;
+
+    /* Generated code comes to about 5 bytes per op for typical programs, so
+       we start with room for 6 and hope to never need to grow the buffer,
+       up to PROG_WINDOW. If there isn't that much memory, emit() will just
+       grow it when it needs to. */
+    prog_size = nops < PROG_WINDOW/6 ? 6*nops + 128 : PROG_WINDOW;
+    if (!(prog = malloc(prog_size)))
+        prog_size = 0;
+
+    /* The preamble finishes with a and the Z flag both matching the
+       current cell. */
+    emit_preamble();
+    if (profile)
+        emit_profile_table();
+    a_off = z_off = 0;
+
+    /* If partial evaluation stopped inside some loops, we still need the
+       code for all of the outermost one, but we jump straight to the place
+       where we're resuming. Everything before that is dead, so we don't
+       generate it at all. */
+    live = eval_pc;
+    resume = 0;
+    for (i = 0; i < eval_pc; i++) {
+        if (ops[i].type == OP_LOOP && ops[i].arg >= eval_pc) {
+            live = i;
+            break;
+        }
+    }
+    if (live < eval_pc) {
+        emit(0xc3);               /* jp $resume */
+        resume = prog_idx;
+        emit(0); emit(0);
+        a_off = z_off = NOWHERE;
+    }
+
+    insn_left = 0;
+    label();
+    peep_on = opt_level > 0;
+    last = last_start = -1;
+    for (i = live; i < nops; i++) {
+        if (resume && i == eval_pc)
+            patch(resume, label());
+        if (i == live || ops[i-1].type == OP_LOOP || ops[i-1].type == OP_END)
+            plan_stretch(i);
+        op_start = prog_idx;
+        first = i;
+        i = generate_op(i);
+        /* A PEEP_BOTH match can delete the last instruction of the op before,
+           so we don't count an op's code until the next op to leave any code
+           behind says where it really ends. */
+        if (stats && op_start < prog_idx) {
+            if (last >= 0)
+                count_code(ops[last].type, last_start, op_start);
+            last = first;
+            last_start = op_start;
+        }
+        if (listing)
+            list_op(first, 0x100L + op_start);
+    }
+    peep_on = 0;
+    if (stats && last >= 0)
+        count_code(ops[last].type, last_start, prog_idx);
+
     emit_postamble();
-    save(output_name);
+}
+
+/* NATIVE CODE */
+
+/* Running the generated .COM file under an emulator is a lot slower than the
+   real thing, so for trying programs out on a PC, -ELF generates a Linux
+   x86-64 executable instead. It works from the same ops, after all of the
+   same optimisation and partial evaluation, but the code generation is much
+   simpler because the x86 has plenty of registers and doesn't care much how
+   they're used.
+
+   rbx points at the current cell, and every op addresses its cell as
+   [rbx+d]. Output and input use the "write" and "read" system calls, one byte
+   at a time, through two little routines at the start of the code, so that
+   the calls to them just go backwards to known addresses.
+
+   The executable has two segments: the code, starting with the ELF header at
+   ELF_CODE, and the tape at ELF_TAPE, which is ELF_TAPESZ bytes (or the size
+   from -TAPE) of zeroes, apart from anything left by partial evaluation. Both
+   have to start at a page boundary in the file as well as in memory. */
+#define ELF_CODE   0x400000L
+#define ELF_TAPE   0x10000000L
+#define ELF_TAPESZ 0x10000L
+
+void emit32(long v) {
+    emit(v&0xff); emit((v>>8)&0xff); emit((v>>16)&0xff); emit((v>>24)&0xff);
+}
+
+void emit64(long v) {
+    emit32(v); emit32(0L);
+}
+
+void put32(int at, long v) {
+    put_byte(at, v&0xff);
+    put_byte(at+1, (v>>8)&0xff);
+    put_byte(at+2, (v>>16)&0xff);
+    put_byte(at+3, (v>>24)&0xff);
+}
+
+/* Patch the 32-bit relative jump or call operand at index "at" to go to the
+   code at index "target". */
+void patch_rel(int at, int target) {
+    put32(at, (long)target - (at+4));
+}
+
+/* Emit an instruction that operates on [rbx+off], with opcode "op" and "reg"
+   in the reg field of the ModRM byte. */
+void x86_cell(unsigned char op, int reg, int off) {
+    emit(op);
+    if (off >= -128 && off <= 127) {
+        emit(0x43 | reg<<3); emit(off);  /* [rbx+d8]  */
+    } else {
+        emit(0x83 | reg<<3); emit32((long)off); /* [rbx+d32] */
+    }
+}
+
+void x86_call(int target) {
+    emit(0xe8);                         /* call $target         */
+    emit32((long)target - (prog_idx+4));
+}
+
+void x86_test() {
+    emit(0x80); emit(0x3b); emit(0);    /* cmp byte [rbx], 0    */
+}
+
+/* The ELF header says it's a 64-bit little-endian x86-64 executable, with
+   2 program headers following, one for each segment. The sizes and the
+   entry point get patched in by elf_postamble(). */
+void elf_header() {
+    emit(0x7f); emit('E'); emit('L'); emit('F');
+    emit(2); emit(1); emit(1); emit(0); /* 64-bit, LE, v1, SysV */
+    emit32(0L); emit32(0L);             /* padding              */
+    emit(2); emit(0);                   /* e_type: executable   */
+    emit(0x3e); emit(0);                /* e_machine: x86-64    */
+    emit32(1L);                         /* e_version            */
+    emit64(0L);                         /* e_entry              */
+    emit64(64L);                        /* e_phoff              */
+    emit64(0L);                         /* e_shoff              */
+    emit32(0L);                         /* e_flags              */
+    emit(64); emit(0);                  /* e_ehsize             */
+    emit(56); emit(0);                  /* e_phentsize          */
+    emit(2); emit(0);                   /* e_phnum              */
+    emit(0); emit(0);                   /* e_shentsize          */
+    emit(0); emit(0);                   /* e_shnum              */
+    emit(0); emit(0);                   /* e_shstrndx           */
+
+    emit32(1L); emit32(5L);             /* PT_LOAD, R+X         */
+    emit64(0L);                         /* p_offset             */
+    emit64(ELF_CODE);                   /* p_vaddr              */
+    emit64(ELF_CODE);                   /* p_paddr              */
+    emit64(0L);                         /* p_filesz             */
+    emit64(0L);                         /* p_memsz              */
+    emit64(0x1000L);                    /* p_align              */
+
+    emit32(1L); emit32(6L);             /* PT_LOAD, R+W         */
+    emit64(0L);                         /* p_offset             */
+    emit64(ELF_TAPE);                   /* p_vaddr              */
+    emit64(ELF_TAPE);                   /* p_paddr              */
+    emit64(0L);                         /* p_filesz             */
+    emit64(0L);                         /* p_memsz              */
+    emit64(0x1000L);                    /* p_align              */
+}
+
+/* putc writes the byte in al, from a copy of it on the stack. getc reads a
+   byte in to al the same way, and leaves the flags set by comparing the
+   return value of "read" with 0, so the caller can skip storing it at EOF. */
+int elf_putc() {
+    int at;
+    at = prog_idx;
+    emit(0x50);                         /* putc: push rax       */
+    emit(0xb8); emit32(1L);             /* mov eax, 1 (write)   */
+    emit(0xbf); emit32(1L);             /* mov edi, 1 (stdout)  */
+    emit(0x48); emit(0x89); emit(0xe6); /* mov rsi, rsp         */
+    emit(0xba); emit32(1L);             /* mov edx, 1           */
+    emit(0x0f); emit(0x05);             /* syscall              */
+    emit(0x58);                         /* pop rax              */
+    emit(0xc3);                         /* ret                  */
+    return at;
+}
+
+int elf_getc() {
+    int at;
+    at = prog_idx;
+    emit(0x50);                         /* getc: push rax       */
+    emit(0x31); emit(0xc0);             /* xor eax, eax (read)  */
+    emit(0x31); emit(0xff);             /* xor edi, edi (stdin) */
+    emit(0x48); emit(0x89); emit(0xe6); /* mov rsi, rsp         */
+    emit(0xba); emit32(1L);             /* mov edx, 1           */
+    emit(0x0f); emit(0x05);             /* syscall              */
+    emit(0x85); emit(0xc0);             /* test eax, eax        */
+    emit(0x58);                         /* pop rax              */
+    emit(0xc3);                         /* ret                  */
+    return at;
+}
+
+/* Generate the x86 code for each op, much as generate_op() does for the Z80.
+   Loops have the same shape, with a guard at the top and the test at the
+   bottom, and use the stack in the same way. A run of MULs is a multiply and
+   add for each target cell, which we have to skip when the control cell is
+   0, because the loop it came from wouldn't have touched the target cells,
+   which might not even be on the tape. The OP_SET that follows the run is
+   generated by itself.
+
+   Returns the index of the last op that was used, like generate_op(). */
+int elf_op(int i, int putc_at, int getc_at) {
+    int n, at;
+    switch (ops[i].type) {
+    case OP_ADD:
+        x86_cell(0x80, 0, ops[i].off); emit(ops[i].val); /* add byte [rbx+d], n */
+        break;
+    case OP_SET:
+        x86_cell(0xc6, 0, ops[i].off); emit(ops[i].val); /* mov byte [rbx+d], n */
+        break;
+    case OP_MUL:
+        emit(0x0f); x86_cell(0xb6, 0, ops[i].arg);   /* movzx eax, byte [rbx+c] */
+        emit(0x85); emit(0xc0);                      /* test eax, eax           */
+        emit(0x0f); emit(0x84);                      /* je $done                */
+        at = prog_idx;
+        emit32(0L);
+        for (; ops[i].type == OP_MUL; i++) {
+            emit(0x6b); emit(0xc8); emit(ops[i].val); /* imul ecx, eax, n       */
+            x86_cell(0x00, 1, ops[i].off);           /* add [rbx+d], cl         */
+        }
+        patch_rel(at, prog_idx);
+        i--;
+        break;
+    case OP_MOVE:
+        n = ops[i].arg;
+        emit(0x48);
+        if (n >= -128 && n <= 127) {
+            emit(0x83); emit(0xc3); emit(n);         /* add rbx, n  */
+        } else {
+            emit(0x81); emit(0xc3); emit32((long)n); /* add rbx, n  */
+        }
+        break;
+    case OP_SCAN:
+        n = ops[i].arg;
+        at = prog_idx;
+        emit(0xeb); emit(0);                         /* jmp test    */
+        emit(0x48);
+        if (n >= -128 && n <= 127) {
+            emit(0x83); emit(0xc3); emit(n);         /* loop: add rbx, n */
+        } else {
+            emit(0x81); emit(0xc3); emit32((long)n); /* loop: add rbx, n */
+        }
+        put_byte(at+1, prog_idx - (at+2));
+        x86_test();                                  /* test: cmp [rbx], 0 */
+        emit(0x75); emit(at+2 - (prog_idx+1));       /* jne loop    */
+        break;
+    case OP_OUT:
+        if (ops[i].val) {
+            emit(0xb0); emit(ops[i].arg);            /* mov al, n   */
+        } else {
+            x86_cell(0x8a, 0, ops[i].off);           /* mov al, [rbx+d] */
+        }
+        x86_call(putc_at);                           /* call putc   */
+        break;
+    case OP_IN:
+        x86_call(getc_at);                           /* call getc   */
+        at = prog_idx;
+        emit(0x7e); emit(0);                         /* jle skip    */
+        x86_cell(0x88, 0, ops[i].off);               /* mov [rbx+d], al */
+        put_byte(at+1, prog_idx - (at+2));
+        break;
+    case OP_LOOP:
+        if (!ops[i].val) {
+            x86_test();
+            emit(0x0f); emit(0x84);                  /* je $exit    */
+            stack[sp++] = prog_idx;
+            emit32(0L);
+        } else {
+            stack[sp++] = 0;
+        }
+        stack[sp++] = prog_idx;
+        break;
+    case OP_END:
+        at = stack[--sp];
+        if (!ops[i].val) {
+            x86_test();
+            emit(0x0f); emit(0x85);                  /* jne $body   */
+            emit32((long)at - (prog_idx+4));
+        }
+        at = stack[--sp];
+        if (at)
+            patch_rel(at, prog_idx);
+        break;
+    }
+    return i;
+}
+
+/* Generate the whole executable. The entry point sets up rbx and writes
+   any output from partial evaluation with a single "write", and then
+   resumes the program from where partial evaluation stopped, in the same
+   way as generate(). The program ends with an "exit" system call, and the
+   output from partial evaluation goes after it. */
+void generate_elf() {
+    int i, live, resume, putc_at, getc_at, entry, str, start, first;
+    long tape_off;
+
+    prog_size = nops < PROG_WINDOW/8 ? 8*nops + 512 : PROG_WINDOW;
+    if (!(prog = malloc(prog_size)))
+        prog_size = 0;
+
+    elf_header();
+    putc_at = elf_putc();
+    getc_at = elf_getc();
+
+    entry = prog_idx;
+    emit(0xbb); emit32(ELF_TAPE + eval_ptr); /* mov ebx, $tape+eval_ptr */
+    str = 0;
+    if (eval_nout) {
+        emit(0xb8); emit32(1L);             /* mov eax, 1 (write)   */
+        emit(0xbf); emit32(1L);             /* mov edi, 1 (stdout)  */
+        emit(0xbe);                         /* mov esi, $str        */
+        str = prog_idx;
+        emit32(0L);
+        emit(0xba); emit32((long)eval_nout); /* mov edx, $n         */
+        emit(0x0f); emit(0x05);             /* syscall              */
+    }
+
+    live = eval_pc;
+    resume = 0;
+    for (i = 0; i < eval_pc; i++) {
+        if (ops[i].type == OP_LOOP && ops[i].arg >= eval_pc) {
+            live = i;
+            break;
+        }
+    }
+    if (live < eval_pc) {
+        emit(0xe9);                         /* jmp $resume          */
+        resume = prog_idx;
+        emit32(0L);
+    }
+    for (i = live; i < nops; i++) {
+        if (resume && i == eval_pc)
+            patch_rel(resume, prog_idx);
+        start = prog_idx;
+        first = i;
+        i = elf_op(i, putc_at, getc_at);
+        if (stats)
+            count_code(ops[first].type, start, prog_idx);
+        if (listing)
+            list_op(first, ELF_CODE + start);
+    }
+
+    emit(0xb8); emit32(60L);                /* mov eax, 60 (exit)   */
+    emit(0x31); emit(0xff);                 /* xor edi, edi         */
+    emit(0x0f); emit(0x05);                 /* syscall              */
+    if (str)
+        put32(str, ELF_CODE + prog_idx);
+    for (i = 0; i < eval_nout; i++)
+        emit(eval_out[i]);
+
+    /* Fill in the header, now that we know where everything is. */
+    put32(24, ELF_CODE + entry);
+    put32(96, (long)prog_idx);
+    put32(104, (long)prog_idx);
+    tape_off = ((long)prog_idx + 0xfff) & ~0xfffL;
+    put32(128, tape_off);
+    put32(152, (long)eval_len);
+    put32(160, tape_size ? tape_size : ELF_TAPESZ);
+
+    while (prog_idx < tape_off)
+        emit(0);
+    for (i = 0; i < eval_len; i++)
+        emit(eval_tape[i]);
+}
+
+/* MAIN */
+
+/* Check whether a command-line argument is the named option. The CCP
+   converts the whole command line to upper case, so we ignore case. */
+int option(char *arg, char *name) {
+    for (; *arg && toupper(*arg) == toupper(*name); arg++, name++);
+    return !*arg && !*name;
+}
+
+/* Make a file name from "base" with the extension "ext". */
+char *file_name(char *base, char *ext) {
+    char *name;
+    name = malloc(strlen(base) + strlen(ext) + 1);
+    strcpy(name, base);
+    strcat(name, ext);
+    return name;
+}
+
+int main(int argc, char **argv) {
+    int i;
+    char *src_name, *base_name, *output_name;
+
+    for (i = 1; i < argc-1; i++) {
+        if (option(argv[i], "-8080")) {
+            i8080 = 1;
+            timing = &i8080_timing;
+        } else if (option(argv[i], "-elf"))
+            elf = 1;
+        else if (option(argv[i], "-bios"))
+            bios = 1;
+        else if (option(argv[i], "-inline"))
+            inline_io = 1;
+        else if (option(argv[i], "-line"))
+            line_input = 1;
+        else if (option(argv[i], "-profile"))
+            profile = 1;
+        else if (option(argv[i], "-stats"))
+            stats = 1;
+        else if (option(argv[i], "-sym"))
+            listing = 1;
+        else if (option(argv[i], "-o0"))
+            opt_level = opt_size = 0;
+        else if (option(argv[i], "-os")) {
+            opt_level = 1;
+            opt_size = 1;
+        } else if (option(argv[i], "-o2")) {
+            opt_level = 2;
+            opt_size = 0;
+        }
+        else if (option(argv[i], "-tape") && i < argc-2) {
+            tape_size = atol(argv[++i]);
+            page_tape = tape_size <= 256;
+            if (tape_size < 1 || tape_size > 0xffffL)
+                break;
+        } else if (option(argv[i], "-eval") && i < argc-2) {
+            eval_steps = atol(argv[++i]);
+            if (eval_steps < 0)
+                break;
+        } else
+            break;
+    }
+    if (i != argc-1) {
+        fprintf(stderr, "usage: BFC [-8080] [-ELF] [-BIOS] [-INLINE] [-LINE] [-O0|-Os|-O2] [-STATS] [-PROFILE] [-SYM] [-TAPE n] [-EVAL n] FOO.BF\n");
+        exit(1);
+    }
+    src_name = argv[i];
+
+    /* Let's generate the output filename.
+
+       Find the final '.' in the filename (if any) and change the extension
+       to ".COM". An ELF executable doesn't need an extension, unless the
+       source file didn't have one either, in which case it gets ".ELF" so
+       that we don't overwrite the source.
+
+       On CP/M there can only be one '.' character, but it doesn't hurt to stay
+       portable. */
+    base_name = file_name(src_name, "");
+    for (i = strlen(base_name)-1; i>0 && base_name[i]!='.'; i--);
+    if (i)
+        base_name[i] = '\0';
+    output_name = file_name(base_name, !elf ? ".COM" : !i ? ".ELF" : "");
+
+    /* -O2 inlines everything it can, and spends longer on partial
+       evaluation. -Os is at the default level, because the things that -O2
+       does only make the code bigger, so if more than one of -O0, -Os and
+       -O2 is given, the last one wins. */
+    if (opt_level == 2)
+        inline_io = 1;
+    if (eval_steps < 0)
+        eval_steps = opt_level == 2 ? 10000 : opt_level ? 1000 : 0;
+    if (profile)
+        eval_steps = 0;
+    track_src = profile || listing;
+
+    /* Allocate the stack, load and parse the source file, and generate the
+       code. With -O0, the ops go straight from the parser to the code
+       generator. */
+    stack = malloc(sizeof(int) * STACKSZ);
+    load(src_name);
+    parse();
+    fclose(src_fp);
+    count_ops(parsed);
+    if (opt_level) {
+        optimise();
+        fold_offsets();
+        known_values();
+    }
+    evaluate();
+    create(output_name);
+    if (listing)
+        open_listing(file_name(base_name, ".SYM"), file_name(base_name, ".LST"));
+    if (elf)
+        generate_elf();
+    else
+        generate();
+
+    /* Save the rest of the generated code to the output file, and print a
+       '\n' to terminate the "++++++++++" on the console. */
+    save();
+    if (listing)
+        close_listing();
     putchar('\n');
+#ifdef __unix__
+    if (elf)
+        chmod(output_name, 0755);
+#endif
+    if (stats)
+        print_stats();
 
     /* All done, great success. */
     return 0;
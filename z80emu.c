@@ -0,0 +1,851 @@
+/* A Cycle-counting Z80 CP/M Emulator for Benchmarking BFC Output
+
+   This is a host-side companion to bfc.c. It loads a .COM file at 0x100,
+   executes it on a Z80 core that counts T-states, and stubs out just enough
+   of CP/M (the BDOS entry at address 5 and the BIOS jump table) for the
+   programs bfc generates to run.
+
+   Compile it on the host:
+   $ cc -O2 -o z80emu z80emu.c
+
+   And run a generated program:
+   $ ./z80emu MANDEL.COM
+
+   The program's console output goes to stdout, with the '\r' of each "\r\n"
+   removed so that it can be compared directly with the output of any other
+   Brainfuck implementation. Console input is read from stdin. When the
+   program returns to CP/M, a summary is written to stderr:
+
+   cycles=12345 io_cycles=678 output_bytes=90 calls=12
+
+   The numbers are for the Z80 code only: the BDOS and BIOS are not emulated
+   instruction-by-instruction, so each call into them is charged a fixed
+   number of T-states instead (see -b and -c below). "io_cycles" is the total
+   of those charges.
+
+   Options go before the filename:
+
+     -m n  stop after n T-states, for programs that never finish
+     -n n  stop after n bytes of output
+     -b n  charge n T-states per BDOS call (default 400)
+     -c n  charge n T-states per BIOS call (default 100)
+     -r    keep the '\r' bytes in the output
+     -q    don't echo console input read through the BDOS
+
+   Memory that the program hasn't written starts out as 0xff rather than 0,
+   so a program that relies on memory the preamble should have cleared will
+   go wrong here too.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* The memory map mirrors a 64K CP/M 2.2 system, so that the preamble clears
+   the same amount of memory it would on real hardware. */
+#define BDOS_ENTRY 0xe406
+#define BIOS_BASE  0xf200
+
+/* BIOS jump table entries, as offsets from BIOS_BASE. */
+#define BIOS_WBOOT  0x03
+#define BIOS_CONST  0x06
+#define BIOS_CONIN  0x09
+#define BIOS_CONOUT 0x0c
+
+/* Flag bits in the F register. */
+#define FS 0x80
+#define FZ 0x40
+#define FY 0x20
+#define FH 0x10
+#define FX 0x08
+#define FP 0x04
+#define FN 0x02
+#define FC 0x01
+
+/* Some global variables: */
+
+unsigned char mem[65536]; /* the entire Z80 address space */
+
+unsigned char A, F, B, C, D, E, H, L;         /* main registers      */
+unsigned char A_, F_, B_, C_, D_, E_, H_, L_; /* alternate registers */
+unsigned short IX, IY, SP, PC;                /* 16-bit registers    */
+unsigned char I, R, IFF1, IFF2;               /* and the rest        */
+
+unsigned long cycles;       /* T-states executed so far             */
+unsigned long io_cycles;    /* T-states charged for BDOS/BIOS calls */
+unsigned long output_bytes; /* bytes written to the console          */
+unsigned long calls;        /* number of BDOS/BIOS calls             */
+
+unsigned long max_cycles; /* stop after this many T-states (0 = never)    */
+unsigned long max_output; /* stop after this many output bytes (0 = never) */
+int bdos_cost;            /* T-states charged per BDOS call               */
+int bios_cost;            /* T-states charged per BIOS call               */
+int raw;                  /* set to 1 to keep '\r' in the output          */
+int quiet;                /* set to 1 to stop BDOS echoing console input  */
+int stopped;              /* set to 1 when a limit has been reached       */
+
+/* Parity lookup: partab[x] is FP if x has an even number of set bits. */
+unsigned char partab[256];
+
+/* CONSOLE I/O */
+
+/* Write a byte to the console on behalf of the emulated program. */
+void conout(int c) {
+    output_bytes++;
+    if (c != '\r' || raw)
+        putchar(c);
+    if (max_output && output_bytes >= max_output) {
+        fflush(stdout);
+        fprintf(stderr, "output limit reached\n");
+        stopped = 1;
+    }
+}
+
+/* Read a byte from the console. A host '\n' becomes "\r\n", as if the input
+   were a CP/M text file, and EOF becomes ^Z. */
+int pending_lf; /* set to 1 when the '\n' of a "\r\n" is still to come */
+
+int conin() {
+    int c;
+    if (pending_lf) {
+        pending_lf = 0;
+        return '\n';
+    }
+    fflush(stdout);
+    c = getchar();
+    if (c == EOF) return 0x1a;
+    if (c == '\n') {
+        pending_lf = 1;
+        return '\r';
+    }
+    return c;
+}
+
+/* MEMORY ACCESS */
+
+#define RD(a) (mem[(unsigned short)(a)])
+#define WR(a, v) (mem[(unsigned short)(a)] = (v))
+#define RD16(a) (RD(a) | (RD((a)+1) << 8))
+#define WR16(a, v) (WR(a, (v)&0xff), WR((a)+1, (v)>>8))
+
+unsigned char fetch() { return RD(PC++); }
+unsigned short fetch16() { unsigned short v = RD16(PC); PC += 2; return v; }
+
+void push(unsigned short v) { SP -= 2; WR16(SP, v); }
+unsigned short pop() { unsigned short v = RD16(SP); SP += 2; return v; }
+
+/* ALU */
+
+/* 8-bit addition and subtraction, with or without carry/borrow. These set
+   every documented flag, which matters because bfc relies on the flags left
+   behind by "add a, n" and friends. */
+void add8(unsigned char v, int carry) {
+    int r = A + v + carry;
+    F = (r & 0x80) | (r & 0x100 ? FC : 0) | (((A & 0xf) + (v & 0xf) + carry) & 0x10)
+        | ((~(A ^ v) & (A ^ r) & 0x80) ? FP : 0) | (r & (FX|FY));
+    A = r;
+    if (!A) F |= FZ;
+}
+
+unsigned char sub8(unsigned char v, int carry) {
+    int r = A - v - carry;
+    unsigned char f = (r & 0x80) | (r & 0x100 ? FC : 0) | FN
+        | (((A & 0xf) - (v & 0xf) - carry) & 0x10)
+        | (((A ^ v) & (A ^ r) & 0x80) ? FP : 0) | (r & (FX|FY));
+    if (!(r & 0xff)) f |= FZ;
+    F = f;
+    return r;
+}
+
+void logic(unsigned char r, unsigned char h) {
+    A = r;
+    F = (A & (FS|FX|FY)) | (A ? 0 : FZ) | h | partab[A];
+}
+
+/* Apply ALU operation "op" (as encoded in bits 3-5 of the opcode) to A. */
+void alu(int op, unsigned char v) {
+    switch (op) {
+    case 0: add8(v, 0); break;
+    case 1: add8(v, F & FC); break;
+    case 2: A = sub8(v, 0); break;
+    case 3: A = sub8(v, F & FC); break;
+    case 4: logic(A & v, FH); break;
+    case 5: logic(A ^ v, 0); break;
+    case 6: logic(A | v, 0); break;
+    case 7: sub8(v, 0); F = (F & ~(FX|FY)) | (v & (FX|FY)); break;
+    }
+}
+
+unsigned char inc8(unsigned char v) {
+    v++;
+    F = (F & FC) | (v & (FS|FX|FY)) | (v ? 0 : FZ) | ((v & 0xf) ? 0 : FH)
+        | (v == 0x80 ? FP : 0);
+    return v;
+}
+
+unsigned char dec8(unsigned char v) {
+    v--;
+    F = (F & FC) | FN | (v & (FS|FX|FY)) | (v ? 0 : FZ)
+        | ((v & 0xf) == 0xf ? FH : 0) | (v == 0x7f ? FP : 0);
+    return v;
+}
+
+unsigned short add16(unsigned short a, unsigned short b) {
+    unsigned long r = (unsigned long)a + b;
+    F = (F & (FS|FZ|FP)) | ((r >> 8) & (FX|FY)) | (r & 0x10000 ? FC : 0)
+        | (((a & 0xfff) + (b & 0xfff)) & 0x1000 ? FH : 0);
+    return r;
+}
+
+unsigned short adc16(unsigned short a, unsigned short b) {
+    unsigned long r = (unsigned long)a + b + (F & FC);
+    F = ((r >> 8) & (FS|FX|FY)) | (r & 0x10000 ? FC : 0)
+        | (((a & 0xfff) + (b & 0xfff) + (F & FC)) & 0x1000 ? FH : 0)
+        | ((~(a ^ b) & (a ^ r) & 0x8000) ? FP : 0) | ((r & 0xffff) ? 0 : FZ);
+    return r;
+}
+
+unsigned short sbc16(unsigned short a, unsigned short b) {
+    unsigned long r = (unsigned long)a - b - (F & FC);
+    F = ((r >> 8) & (FS|FX|FY)) | (r & 0x10000 ? FC : 0) | FN
+        | (((a & 0xfff) - (b & 0xfff) - (F & FC)) & 0x1000 ? FH : 0)
+        | (((a ^ b) & (a ^ r) & 0x8000) ? FP : 0) | ((r & 0xffff) ? 0 : FZ);
+    return r;
+}
+
+/* Rotates and shifts from the CB page ("op" is bits 3-5 of the opcode). */
+unsigned char rot(int op, unsigned char v) {
+    int c;
+    switch (op) {
+    case 0: c = v >> 7; v = (v << 1) | c; break;              /* rlc */
+    case 1: c = v & 1; v = (v >> 1) | (c << 7); break;        /* rrc */
+    case 2: c = v >> 7; v = (v << 1) | (F & FC); break;       /* rl  */
+    case 3: c = v & 1; v = (v >> 1) | ((F & FC) << 7); break; /* rr  */
+    case 4: c = v >> 7; v = v << 1; break;                    /* sla */
+    case 5: c = v & 1; v = (v >> 1) | (v & 0x80); break;      /* sra */
+    case 6: c = v >> 7; v = (v << 1) | 1; break;              /* sll */
+    default: c = v & 1; v = v >> 1; break;                    /* srl */
+    }
+    F = (v & (FS|FX|FY)) | (v ? 0 : FZ) | partab[v] | c;
+    return v;
+}
+
+/* REGISTER ACCESS */
+
+/* Register operands are encoded as 0-7 = b, c, d, e, h, l, (hl), a. When the
+   instruction has a DD or FD prefix, h and l mean the halves of ix or iy, and
+   (hl) means (ix+d) or (iy+d); "idx" says which of these applies (0 for hl,
+   1 for ix, 2 for iy) and "addr" is the already-computed memory address. */
+unsigned char getr(int r, int idx, unsigned short addr) {
+    switch (r) {
+    case 0: return B;
+    case 1: return C;
+    case 2: return D;
+    case 3: return E;
+    case 4: return idx == 1 ? IX >> 8 : idx == 2 ? IY >> 8 : H;
+    case 5: return idx == 1 ? IX & 0xff : idx == 2 ? IY & 0xff : L;
+    case 6: return RD(addr);
+    default: return A;
+    }
+}
+
+void setr(int r, int idx, unsigned short addr, unsigned char v) {
+    switch (r) {
+    case 0: B = v; break;
+    case 1: C = v; break;
+    case 2: D = v; break;
+    case 3: E = v; break;
+    case 4:
+        if (idx == 1) IX = (IX & 0xff) | (v << 8);
+        else if (idx == 2) IY = (IY & 0xff) | (v << 8);
+        else H = v;
+        break;
+    case 5:
+        if (idx == 1) IX = (IX & 0xff00) | v;
+        else if (idx == 2) IY = (IY & 0xff00) | v;
+        else L = v;
+        break;
+    case 6: WR(addr, v); break;
+    default: A = v; break;
+    }
+}
+
+/* Register pairs are encoded as 0-3 = bc, de, hl, sp (or af for push/pop). */
+unsigned short getrp(int p, int idx) {
+    switch (p) {
+    case 0: return (B << 8) | C;
+    case 1: return (D << 8) | E;
+    case 2: return idx == 1 ? IX : idx == 2 ? IY : (H << 8) | L;
+    default: return SP;
+    }
+}
+
+void setrp(int p, int idx, unsigned short v) {
+    switch (p) {
+    case 0: B = v >> 8; C = v; break;
+    case 1: D = v >> 8; E = v; break;
+    case 2:
+        if (idx == 1) IX = v;
+        else if (idx == 2) IY = v;
+        else { H = v >> 8; L = v; }
+        break;
+    default: SP = v; break;
+    }
+}
+
+int cond(int cc) {
+    switch (cc) {
+    case 0: return !(F & FZ);
+    case 1: return F & FZ;
+    case 2: return !(F & FC);
+    case 3: return F & FC;
+    case 4: return !(F & FP);
+    case 5: return F & FP;
+    case 6: return !(F & FS);
+    default: return F & FS;
+    }
+}
+
+/* INSTRUCTION EXECUTION */
+
+/* CB-prefixed instructions. With an index prefix, the displacement has
+   already been read and "addr" is the target, and the result is also copied
+   into register "r" unless r is 6 (the undocumented DDCB behaviour). */
+void exec_cb(int idx, unsigned short addr) {
+    int op = fetch();
+    int x = op >> 6, y = (op >> 3) & 7, r = op & 7;
+    unsigned char v;
+    if (idx) {
+        v = RD(addr);
+        cycles += x == 1 ? 20 : 23;
+    } else {
+        addr = (H << 8) | L;
+        v = getr(r, 0, addr);
+        cycles += r == 6 ? (x == 1 ? 12 : 15) : 8;
+    }
+    switch (x) {
+    case 0: v = rot(y, v); break;
+    case 1:
+        F = (F & FC) | FH | ((v & (1 << y)) ? (y == 7 ? FS : 0) : (FZ|FP))
+            | (v & (FX|FY));
+        return;
+    case 2: v &= ~(1 << y); break;
+    case 3: v |= 1 << y; break;
+    }
+    if (idx) {
+        WR(addr, v);
+        if (r != 6) setr(r, 0, 0, v);
+    } else {
+        setr(r, 0, addr, v);
+    }
+}
+
+/* ED-prefixed instructions. */
+void exec_ed() {
+    int op = fetch();
+    int x = op >> 6, y = (op >> 3) & 7, z = op & 7, p = y >> 1, q = y & 1;
+    unsigned short hl = (H << 8) | L, bc, de;
+    unsigned char v;
+
+    if (x == 1) {
+        switch (z) {
+        case 0: /* in r, (c) - there is no I/O hardware, so read 0xff */
+            v = 0xff;
+            if (y != 6) setr(y, 0, 0, v);
+            F = (F & FC) | (v & (FS|FX|FY)) | partab[v];
+            cycles += 12;
+            return;
+        case 1: /* out (c), r */
+            cycles += 12;
+            return;
+        case 2:
+            hl = q ? adc16(hl, getrp(p, 0)) : sbc16(hl, getrp(p, 0));
+            H = hl >> 8; L = hl;
+            cycles += 15;
+            return;
+        case 3: {
+            unsigned short a = fetch16();
+            if (q) setrp(p, 0, RD16(a));
+            else WR16(a, getrp(p, 0));
+            cycles += 20;
+            return;
+        }
+        case 4: /* neg */
+            v = A; A = 0; A = sub8(v, 0);
+            cycles += 8;
+            return;
+        case 5: /* retn/reti */
+            PC = pop(); IFF1 = IFF2;
+            cycles += 14;
+            return;
+        case 6: /* im n */
+            cycles += 8;
+            return;
+        default:
+            switch (y) {
+            case 0: I = A; cycles += 9; return;
+            case 1: R = A; cycles += 9; return;
+            case 2: case 3:
+                A = y == 2 ? I : R;
+                F = (F & FC) | (A & (FS|FX|FY)) | (A ? 0 : FZ) | (IFF2 ? FP : 0);
+                cycles += 9;
+                return;
+            case 4: case 5: { /* rrd, rld */
+                unsigned char m = RD(hl);
+                if (y == 4) {
+                    WR(hl, (A << 4) | (m >> 4));
+                    A = (A & 0xf0) | (m & 0xf);
+                } else {
+                    WR(hl, (m << 4) | (A & 0xf));
+                    A = (A & 0xf0) | (m >> 4);
+                }
+                F = (F & FC) | (A & (FS|FX|FY)) | (A ? 0 : FZ) | partab[A];
+                cycles += 18;
+                return;
+            }
+            default:
+                cycles += 8;
+                return;
+            }
+        }
+    }
+
+    if (x == 2 && y >= 4 && z <= 3) {
+        /* Block instructions: ldi/ldd/ldir/lddr, cpi/cpd/cpir/cpdr and the
+           block I/O instructions (which just count down b here). */
+        int dir = (y & 1) ? -1 : 1, repeat = y >= 6;
+        do {
+            bc = (B << 8) | C;
+            de = (D << 8) | E;
+            hl = (H << 8) | L;
+            if (z == 0) {
+                v = RD(hl);
+                WR(de, v);
+                hl += dir; de += dir; bc--;
+                F = (F & (FS|FZ|FC)) | (bc ? FP : 0);
+                B = bc >> 8; C = bc; D = de >> 8; E = de; H = hl >> 8; L = hl;
+                if (repeat && bc) { cycles += 21; continue; }
+                cycles += 16;
+                break;
+            } else if (z == 1) {
+                unsigned char c = F & FC;
+                v = RD(hl);
+                sub8(v, 0);
+                hl += dir; bc--;
+                F = (F & (FS|FZ|FH)) | FN | c | (bc ? FP : 0);
+                B = bc >> 8; C = bc; H = hl >> 8; L = hl;
+                if (repeat && bc && !(F & FZ)) { cycles += 21; continue; }
+                cycles += 16;
+                break;
+            } else {
+                B--;
+                hl += dir;
+                H = hl >> 8; L = hl;
+                F = (F & FC) | FN | (B ? 0 : FZ);
+                if (repeat && B) { cycles += 21; continue; }
+                cycles += 16;
+                break;
+            }
+        } while (1);
+        return;
+    }
+
+    /* Anything else on the ED page behaves as a two-byte nop. */
+    cycles += 8;
+}
+
+/* Execute one instruction, including any prefixes. */
+void step() {
+    int op, x, y, z, p, q, idx = 0;
+    unsigned short addr = 0, t;
+    unsigned char v;
+
+    R = (R & 0x80) | ((R + 1) & 0x7f);
+    op = fetch();
+    while (op == 0xdd || op == 0xfd) {
+        idx = op == 0xdd ? 1 : 2;
+        cycles += 4;
+        op = fetch();
+    }
+    if (op == 0xed) { exec_ed(); return; }
+
+    x = op >> 6; y = (op >> 3) & 7; z = op & 7; p = y >> 1; q = y & 1;
+
+    /* Work out the address of any (hl) or (ix+d) operand up front. The
+       displacement byte is always immediately after the opcode (or after
+       the CB of a DDCB instruction). */
+    if (idx && (op == 0xcb || (x == 1 && (y == 6 || z == 6) && op != 0x76)
+                || (x == 2 && z == 6) || (x == 0 && z >= 4 && z <= 6 && y == 6))) {
+        signed char d = fetch();
+        addr = (idx == 1 ? IX : IY) + d;
+        cycles += 8;
+        /* ld (ix+d), n reads one byte fewer than it is charged for */
+        if (op == 0x36) cycles -= 3;
+    } else {
+        addr = (H << 8) | L;
+    }
+    if (op == 0xcb) {
+        if (idx) cycles -= 12; /* exec_cb() charges the whole DDCB timing */
+        exec_cb(idx, addr);
+        return;
+    }
+
+    switch (x) {
+    case 0:
+        switch (z) {
+        case 0:
+            switch (y) {
+            case 0: cycles += 4; break; /* nop */
+            case 1: /* ex af, af' */
+                v = A; A = A_; A_ = v; v = F; F = F_; F_ = v;
+                cycles += 4;
+                break;
+            case 2: /* djnz */
+                v = fetch();
+                if (--B) { PC += (signed char)v; cycles += 13; }
+                else cycles += 8;
+                break;
+            case 3: /* jr */
+                v = fetch();
+                PC += (signed char)v;
+                cycles += 12;
+                break;
+            default: /* jr cc */
+                v = fetch();
+                if (cond(y - 4)) { PC += (signed char)v; cycles += 12; }
+                else cycles += 7;
+                break;
+            }
+            break;
+        case 1:
+            if (q) { setrp(2, idx, add16(getrp(2, idx), getrp(p, idx))); cycles += 11; }
+            else { setrp(p, idx, fetch16()); cycles += 10; }
+            break;
+        case 2:
+            switch (y) {
+            case 0: WR((B << 8) | C, A); cycles += 7; break;
+            case 1: A = RD((B << 8) | C); cycles += 7; break;
+            case 2: WR((D << 8) | E, A); cycles += 7; break;
+            case 3: A = RD((D << 8) | E); cycles += 7; break;
+            case 4: t = fetch16(); WR16(t, getrp(2, idx)); cycles += 16; break;
+            case 5: t = fetch16(); setrp(2, idx, RD16(t)); cycles += 16; break;
+            case 6: t = fetch16(); WR(t, A); cycles += 13; break;
+            default: t = fetch16(); A = RD(t); cycles += 13; break;
+            }
+            break;
+        case 3:
+            setrp(p, idx, getrp(p, idx) + (q ? -1 : 1));
+            cycles += 6;
+            break;
+        case 4:
+            setr(y, idx, addr, inc8(getr(y, idx, addr)));
+            cycles += y == 6 ? 11 : 4;
+            break;
+        case 5:
+            setr(y, idx, addr, dec8(getr(y, idx, addr)));
+            cycles += y == 6 ? 11 : 4;
+            break;
+        case 6:
+            setr(y, idx, addr, fetch());
+            cycles += y == 6 ? 10 : 7;
+            break;
+        default:
+            switch (y) {
+            case 0: /* rlca */
+                A = (A << 1) | (A >> 7);
+                F = (F & (FS|FZ|FP)) | (A & (FX|FY|FC));
+                break;
+            case 1: /* rrca */
+                F = (F & (FS|FZ|FP)) | (A & FC);
+                A = (A >> 1) | (A << 7);
+                F |= A & (FX|FY);
+                break;
+            case 2: /* rla */
+                v = A >> 7;
+                A = (A << 1) | (F & FC);
+                F = (F & (FS|FZ|FP)) | (A & (FX|FY)) | v;
+                break;
+            case 3: /* rra */
+                v = A & 1;
+                A = (A >> 1) | ((F & FC) << 7);
+                F = (F & (FS|FZ|FP)) | (A & (FX|FY)) | v;
+                break;
+            case 4: { /* daa */
+                int c = F & FC, h = F & FH, n = F & FN, lo = A & 0xf;
+                unsigned char diff = 0;
+                if (h || lo > 9) diff |= 0x06;
+                if (c || A > 0x99) { diff |= 0x60; c = FC; }
+                h = n ? (h && lo < 6 ? FH : 0) : (lo > 9 ? FH : 0);
+                A = n ? A - diff : A + diff;
+                F = (A & (FS|FX|FY)) | (A ? 0 : FZ) | partab[A] | n | c | h;
+                break;
+            }
+            case 5: /* cpl */
+                A = ~A;
+                F = (F & (FS|FZ|FP|FC)) | FH | FN | (A & (FX|FY));
+                break;
+            case 6: /* scf */
+                F = (F & (FS|FZ|FP)) | FC | (A & (FX|FY));
+                break;
+            default: /* ccf */
+                F = ((F & (FS|FZ|FP|FC)) | ((F & FC) ? FH : 0) | (A & (FX|FY))) ^ FC;
+                break;
+            }
+            cycles += 4;
+            break;
+        }
+        break;
+
+    case 1:
+        if (op == 0x76) { /* halt: there are no interrupts, so stop */
+            fprintf(stderr, "halt at 0x%04x\n", PC - 1);
+            stopped = 1;
+            cycles += 4;
+            break;
+        }
+        /* With an index prefix, only the side that isn't (ix+d) is
+           substituted, so "ld h, (ix+d)" loads the real h. */
+        if (y == 6) setr(6, idx, addr, getr(z, 0, addr));
+        else if (z == 6) setr(y, 0, addr, getr(6, idx, addr));
+        else setr(y, idx, addr, getr(z, idx, addr));
+        cycles += (y == 6 || z == 6) ? 7 : 4;
+        break;
+
+    case 2:
+        alu(y, getr(z, idx, addr));
+        cycles += z == 6 ? 7 : 4;
+        break;
+
+    default:
+        switch (z) {
+        case 0: /* ret cc */
+            if (cond(y)) { PC = pop(); cycles += 11; }
+            else cycles += 5;
+            break;
+        case 1:
+            if (!q) {
+                t = pop();
+                if (p == 3) { A = t >> 8; F = t; }
+                else setrp(p, idx, t);
+                cycles += 10;
+            } else {
+                switch (p) {
+                case 0: PC = pop(); cycles += 10; break; /* ret */
+                case 1: /* exx */
+                    v = B; B = B_; B_ = v; v = C; C = C_; C_ = v;
+                    v = D; D = D_; D_ = v; v = E; E = E_; E_ = v;
+                    v = H; H = H_; H_ = v; v = L; L = L_; L_ = v;
+                    cycles += 4;
+                    break;
+                case 2: PC = getrp(2, idx); cycles += 4; break; /* jp (hl) */
+                default: SP = getrp(2, idx); cycles += 6; break; /* ld sp, hl */
+                }
+            }
+            break;
+        case 2: /* jp cc, nn */
+            t = fetch16();
+            if (cond(y)) PC = t;
+            cycles += 10;
+            break;
+        case 3:
+            switch (y) {
+            case 0: PC = fetch16(); cycles += 10; break; /* jp nn */
+            case 2: fetch(); cycles += 11; break;        /* out (n), a */
+            case 3: fetch(); A = 0xff; cycles += 11; break; /* in a, (n) */
+            case 4: /* ex (sp), hl */
+                t = RD16(SP);
+                WR16(SP, getrp(2, idx));
+                setrp(2, idx, t);
+                cycles += 19;
+                break;
+            case 5: /* ex de, hl */
+                v = D; D = H; H = v; v = E; E = L; L = v;
+                cycles += 4;
+                break;
+            case 6: IFF1 = IFF2 = 0; cycles += 4; break; /* di */
+            default: IFF1 = IFF2 = 1; cycles += 4; break; /* ei */
+            }
+            break;
+        case 4: /* call cc, nn */
+            t = fetch16();
+            if (cond(y)) { push(PC); PC = t; cycles += 17; }
+            else cycles += 10;
+            break;
+        case 5:
+            if (!q) {
+                if (p == 3) push((A << 8) | F);
+                else push(getrp(p, idx));
+                cycles += 11;
+            } else { /* call nn (the other prefixes were handled above) */
+                t = fetch16();
+                push(PC);
+                PC = t;
+                cycles += 17;
+            }
+            break;
+        case 6:
+            alu(y, fetch());
+            cycles += 7;
+            break;
+        default: /* rst */
+            push(PC);
+            PC = y * 8;
+            cycles += 11;
+            break;
+        }
+        break;
+    }
+}
+
+/* CP/M */
+
+/* Calls into the BDOS and BIOS are intercepted when the PC reaches their
+   entry points. The requested function is carried out on the host, the
+   fixed charge for the call is added to the cycle count, and we "ret" back
+   to the caller. Returns 0 when the program has exited. */
+int trap() {
+    int i, n;
+    unsigned short de;
+
+    if (PC == 0 || PC == BIOS_BASE + BIOS_WBOOT)
+        return 0;
+
+    if (PC == BDOS_ENTRY) {
+        calls++;
+        io_cycles += bdos_cost;
+        cycles += bdos_cost;
+        de = (D << 8) | E;
+        switch (C) {
+        case 0: /* system reset */
+            return 0;
+        case 1: /* console input, with echo */
+            A = conin();
+            if (!quiet) conout(A);
+            break;
+        case 2: /* console output */
+            conout(E);
+            break;
+        case 6: /* direct console I/O */
+            if (E == 0xff) A = conin();
+            else conout(E);
+            break;
+        case 9: /* print string */
+            for (; RD(de) != '$'; de++)
+                conout(RD(de));
+            break;
+        case 10: /* read console buffer, with echo */
+            n = 0;
+            while (n < RD(de)) {
+                i = conin();
+                if (i == '\r' || i == 0x1a) {
+                    pending_lf = 0;
+                    break;
+                }
+                if (!quiet) conout(i);
+                WR(de + 2 + n, i);
+                n++;
+            }
+            WR(de + 1, n);
+            if (!quiet)
+                conout('\r'); /* like CP/M 2.2, no '\n' */
+            break;
+        case 11: /* console status */
+            A = 0;
+            break;
+        default:
+            fprintf(stderr, "unsupported BDOS function %d\n", C);
+            return 0;
+        }
+        L = A; H = B = 0;
+        PC = pop();
+        return 1;
+    }
+
+    if (PC >= BIOS_BASE && PC < BIOS_BASE + 0x33) {
+        calls++;
+        io_cycles += bios_cost;
+        cycles += bios_cost;
+        switch (PC - BIOS_BASE) {
+        case BIOS_CONST: A = 0xff; break;
+        case BIOS_CONIN: A = conin(); break;
+        case BIOS_CONOUT: conout(C); break;
+        default:
+            fprintf(stderr, "unsupported BIOS call at 0x%04x\n", PC);
+            return 0;
+        }
+        PC = pop();
+        return 1;
+    }
+
+    return 1;
+}
+
+/* Set up the zero page so that address 0 goes to the BIOS warm boot entry
+   and address 5 goes to the BDOS, then load the program at 0x100. */
+void load(char *f) {
+    FILE *fp;
+    int i, n;
+
+    for (i = 0; i < 256; i++) {
+        int bits = 0, v = i;
+        while (v) { bits += v & 1; v >>= 1; }
+        partab[i] = (bits & 1) ? 0 : FP;
+    }
+
+    memset(mem, 0xff, sizeof(mem));
+    mem[0] = 0xc3; mem[1] = (BIOS_BASE + BIOS_WBOOT) & 0xff; mem[2] = (BIOS_BASE + BIOS_WBOOT) >> 8;
+    mem[5] = 0xc3; mem[6] = BDOS_ENTRY & 0xff; mem[7] = BDOS_ENTRY >> 8;
+
+    if (!(fp = fopen(f, "rb"))) {
+        fprintf(stderr, "error: can't read %s\n", f);
+        exit(1);
+    }
+    n = fread(mem + 0x100, 1, BDOS_ENTRY - 0x100, fp);
+    fclose(fp);
+    if (n <= 0) {
+        fprintf(stderr, "error: %s is empty\n", f);
+        exit(1);
+    }
+
+    PC = 0x100;
+    SP = BDOS_ENTRY - 6;
+    push(0);
+}
+
+/* MAIN */
+
+int main(int argc, char **argv) {
+    int i;
+
+    bdos_cost = 400;
+    bios_cost = 100;
+
+    for (i = 1; i < argc - 1; i++) {
+        if (!strcmp(argv[i], "-m") && i + 1 < argc - 1) max_cycles = strtoul(argv[++i], 0, 10);
+        else if (!strcmp(argv[i], "-n") && i + 1 < argc - 1) max_output = strtoul(argv[++i], 0, 10);
+        else if (!strcmp(argv[i], "-b") && i + 1 < argc - 1) bdos_cost = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-c") && i + 1 < argc - 1) bios_cost = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-r")) raw = 1;
+        else if (!strcmp(argv[i], "-q")) quiet = 1;
+        else break;
+    }
+    if (i != argc - 1) {
+        fprintf(stderr, "usage: z80emu [-m maxcycles] [-n maxoutput] [-b bdoscost] [-c bioscost] [-r] [-q] FOO.COM\n");
+        exit(1);
+    }
+
+    load(argv[i]);
+
+    while (!stopped && trap()) {
+        step();
+        if (max_cycles && cycles >= max_cycles) {
+            fprintf(stderr, "cycle limit reached\n");
+            break;
+        }
+    }
+
+    fflush(stdout);
+    fprintf(stderr, "cycles=%lu io_cycles=%lu output_bytes=%lu calls=%lu\n",
+            cycles, io_cycles, output_bytes, calls);
+    return 0;
+}